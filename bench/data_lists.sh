@@ -0,0 +1,30 @@
+#!/usr/bin/env bash
+# Assembles 512K 32-bit values in a data section, one dw per line and
+# 16 per .word line, and times it. Pass another build to compare.
+set -e
+FAB=${1:-build/fab128}
+COUNT=${2:-524288}
+DIR=$(mktemp -d)
+trap 'rm -rf $DIR' EXIT
+
+header() {
+	printf '.section .text\n.global _start\n_start:\n\tli a0, 0\n\tsyscall 1\n.section .data\n'
+}
+header > $DIR/dw.asm
+awk -v n=$COUNT 'BEGIN { for (i = 0; i < n; i++) printf "\tdw %d\n", i }' >> $DIR/dw.asm
+header > $DIR/word.asm
+awk -v n=$COUNT 'BEGIN {
+	for (i = 0; i < n; i += 16) {
+		printf "\t.word"
+		for (j = i; j < i + 16 && j < n; j++) printf " %d", j
+		printf "\n"
+	}
+}' >> $DIR/word.asm
+
+# Builds from before --stats only get timed
+STATS=
+if $FAB 2>&1 | grep -q -- --stats; then STATS=--stats; fi
+for input in dw word; do
+	echo "== $COUNT values, $input"
+	time $FAB $STATS $DIR/$input.asm $DIR/$input | grep -i "peak" || true
+done
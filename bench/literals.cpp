@@ -0,0 +1,82 @@
+#include "literal.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/* Parses a mix of short decimal, 32-bit hex and 128-bit hex literals,
+   with parse_literal() and with the substr + stoull + atoi parsing the
+   tokenizer had before it. */
+
+static __uint128_t old_parse(std::string_view word)
+{
+	__uint128_t value = 0;
+	if (word.size() > 2 && word[1] == 'x') {
+		if (word.size() > 18) {
+			/* 128-bit constant */
+			const size_t upsize = word.size()-18;
+			std::string lower {word.substr(word.size()-16)};
+			std::string upper {word.substr(2, upsize)};
+			value = std::stoull(upper.c_str(), nullptr, 16);
+			value <<= 64;
+			value |= std::stoull(lower.c_str(), nullptr, 16);
+		} else {
+			/* 8-64-bit constant */
+			value = std::stoull(std::string(word.substr(2)), nullptr, 16);
+		}
+	} else if (word.size() > 2 && word[1] == 'b') {
+		value = std::stoull(std::string(word.substr(2)), nullptr, 2);
+	} else { // base 10
+		value = (int64_t)atoi(std::string(word).c_str());
+	}
+	return value;
+}
+
+static __uint128_t new_parse(std::string_view word)
+{
+	__uint128_t value = 0;
+	parse_literal(word.data(), word.data() + word.size(), value);
+	return value;
+}
+
+template <typename Parse>
+static void measure(const char* name, const std::vector<std::string>& literals, Parse parse)
+{
+	const auto start = std::chrono::steady_clock::now();
+	__uint128_t sum = 0;
+	for (const auto& literal : literals)
+		sum += parse(literal);
+	const auto end = std::chrono::steady_clock::now();
+	printf("%-14s %6.1f ms  (checksum %016llx)\n", name,
+		std::chrono::duration<double, std::milli>(end - start).count(),
+		(unsigned long long)(sum ^ (sum >> 64)));
+}
+
+int main(int argc, char** argv)
+{
+	const size_t count = (argc > 1) ? strtoull(argv[1], nullptr, 10) : 2000000;
+	std::mt19937_64 rng(5);
+	std::vector<std::string> literals;
+	literals.reserve(count);
+	char buffer[64];
+	for (size_t i = 0; i < count; i++) {
+		switch (i % 3) {
+		case 0:
+			snprintf(buffer, sizeof(buffer), "%u", (unsigned)(rng() % 10000));
+			break;
+		case 1:
+			snprintf(buffer, sizeof(buffer), "0x%X", (unsigned)rng());
+			break;
+		default:
+			snprintf(buffer, sizeof(buffer), "0x%016llX%016llX",
+				(unsigned long long)rng() | (1ull << 63), (unsigned long long)rng());
+		}
+		literals.push_back(buffer);
+	}
+	printf("%zu literals\n", count);
+	measure("stoull + atoi", literals, old_parse);
+	measure("parse_literal", literals, new_parse);
+}
@@ -0,0 +1,30 @@
+.section .text
+.global _start
+_start:             ;; Constants, and how many instructions set needs,
+                    ;; with what it took before. For a larger corpus,
+                    ;; see tests/constants.cpp
+small:
+	set a0, t0, 0x7FF                ;; 1: addi (was 1)
+	set a0, t0, -2048                ;; 1: addi (was 10, wrong)
+	set a0, t0, 0x12345              ;; 2: lui + addiw (was 2)
+	set a0, t0, 0x7FFFFFFF           ;; 2: addiw wraps around (was 2, wrong)
+	set a0, t0, 0x80000000           ;; 2: not sign-extended (was 1, wrong)
+	set a0, t0, 0xFFFFFFFF           ;; 2: addi -1 + srli (was 1, wrong)
+shifted:
+	set a0, t0, 0x12345678_00000123  ;; 4: shifted up, low bits added (was 9)
+	set a0, t0, 0x8000000000000000   ;; 2: sign-extended from bit 63 (was 8, wrong)
+	set a0, t0, 0x00FFFFFF_FFFFFFFF  ;; 2: leading zeroes shifted out (was 9, wrong)
+	set a0, t0, 0x10000000_00000000_00000000_00000000 ;; 2 (was 10)
+inverted:
+	set a0, t0, -1                   ;; 1 (was 10, wrong)
+	set a0, t0, 0xFFFFFFFF_FFFFFFFF_FFFFFFFF_FFFFF000 ;; 1: lui (was 10, wrong)
+	set a0, t0, 0xFFFFFFFF_0000FFFF_FFFFFFFF_FFFFFFFF ;; 3 (was 11, wrong)
+split:
+	set a0, t0, 0x12345678_12345678  ;; 4: repeated with the temporary (was 10)
+	set a0, t0, 0xDEADBEEF_CAFEBABE  ;; 7 (was 10, wrong)
+	set a0, t0, 0x01234567_89ABCDEF_FEDCBA98_76543210 ;; 14 (was 14, wrong)
+	set a0, a0, 0x01234567_89ABCDEF_FEDCBA98_76543210 ;; 16: no temporary (was 14, wrong)
+
+	li a0, 0        ;; Exit code (1st arg)
+	syscall 1       ;; Execute system call 1 (exit)
+.endfunc _start
@@ -2,92 +2,330 @@
 #include "opcodes.hpp"
 #include "pseudo_ops.hpp"
 #include "registers.hpp"
+#include <algorithm>
 #include <cassert>
 
-Assembler::Assembler(const Options& opt)
-	: options(opt)
+Assembler::Assembler(const Options& opt, Sources& sources, uint32_t file)
+	: options(opt), m_sources(sources), m_file(file)
 {
 	this->set_section(".text"); /* Default section */
 	current_section().set_base_address(options.base);
 }
 
-void Assembler::assemble(const std::vector<Token>& tv,
-	const char* rpath)
+void Assembler::assemble(const TokenStream& tv,
+	const char* rpath, bool lasting)
 {
 	const auto prev_tokens = this->tokens;
 	const auto prev_index = this->index;
 	const auto prev_rpath = this->m_realpath;
+	const auto prev_stream = this->m_stream;
+	const auto prev_lasting = this->m_lasting;
 	this->tokens = &tv;
 	this->index = 0;
 	this->m_realpath = rpath;
+	this->m_stream = nullptr;
+	this->m_lasting = lasting;
+
+	this->assemble_tokens();
+
+	/* Restore any previous assembler operation. */
+	this->tokens = prev_tokens;
+	this->index = prev_index;
+	this->m_realpath = prev_rpath;
+	this->m_stream = prev_stream;
+	this->m_lasting = prev_lasting;
+}
+void Assembler::assemble_file(const std::string& filename)
+{
+	auto& file = m_sources.open(filename, m_realpath);
+	std::call_once(file.lexed, [&] {
+		Conditionals conditionals {options.defines};
+		file.tokens = conditionals.split(file.text, file.arena);
+		conditionals.finish();
+		this->intern_symbols(file.tokens);
+		file.owner = this;
+
+		if (options.verbose_tokens) {
+			for (size_t i = 0; i < file.tokens.size(); i++)
+				printf("Token: %s\n", file.tokens[i].to_string().c_str());
+		}
+	});
+	/* Symbol IDs are only known to the assembler that lexed the file,
+	   so others intern a copy of the tokens of their own, once */
+	const TokenStream* tokens = &file.tokens;
+	if (file.owner != this) {
+		auto it = m_interned.find(&file);
+		if (it == m_interned.end()) {
+			it = m_interned.emplace(&file, file.tokens).first;
+			this->intern_symbols(it->second);
+		}
+		tokens = &it->second;
+	}
+	this->presize(*tokens);
+	/* Source files stay until the assembler is gone */
+	this->assemble(*tokens, file.directory.c_str(), true);
+}
+void Assembler::assemble(TokenQueue& queue, const char* rpath)
+{
+	static const TokenStream no_tokens;
+	this->tokens = &no_tokens;
+	this->index = 0;
+	this->m_realpath = rpath;
+	this->m_stream = &queue;
+	/* Batches are gone once assembled */
+	this->m_lasting = false;
+
+	this->assemble_tokens();
+
+	this->tokens = nullptr;
+	this->m_stream = nullptr;
+	this->m_batch = nullptr;
+	this->m_prev_batch = nullptr;
+}
+bool Assembler::refill()
+{
+	if (m_stream == nullptr) return false;
+	/* The previous batch has to stay alive, as the statement
+	   being assembled may still refer to its tokens. */
+	std::unique_ptr<TokenBatch> batch = m_stream->pop();
+	if (batch == nullptr) return false;
+	this->intern_symbols(batch->tokens);
+	this->presize(batch->tokens);
+	this->m_prev_batch = std::move(m_batch);
+	this->m_batch = std::move(batch);
+	this->tokens = &m_batch->tokens;
+	this->index = 0;
+	return true;
+}
+/* Numeric labels and .L labels, with their references */
+static bool is_local_name(std::string_view name)
+{
+	return (name.size() > 2 && name[0] == '.' && name[1] == 'L')
+		|| (!name.empty() && name[0] >= '0' && name[0] <= '9');
+}
+
+/* Symbols are interned once per lexed file or batch, and the ID is
+   kept in the token, so that assembling never hashes a name. Local
+   labels are bound as they are assembled instead, and are left
+   as NONE. */
+void Assembler::intern_symbols(TokenStream& tokens)
+{
+	for (size_t i = 0; i < tokens.size(); i++) {
+		const auto tk = tokens[i];
+		if (tk.type() == TK_SYMBOL || tk.type() == TK_LABEL) {
+			tokens.set_symbol(i, is_local_name(tk.value())
+				? SymbolTable::NONE : m_symbols.intern(tk.value()));
+		}
+	}
+}
+
+/* A numeric label is a new label each time it appears, and it is the
+   one that forward references since the previous one are waiting
+   for. A .L label is the same label throughout its scope. */
+symbol_id Assembler::bind_label(const Token& tk)
+{
+	const auto name = tk.value();
+	if (name[0] == '.')
+		return bind_reference(tk);
+	symbol_id id;
+	auto it = m_scope.next.find(name);
+	if (it != m_scope.next.end()) {
+		id = it->second;
+		m_scope.next.erase(it);
+	} else {
+		id = m_symbols.add_local(name);
+	}
+	m_scope.previous[m_symbols.name(id)] = id;
+	return id;
+}
+symbol_id Assembler::bind_reference(const Token& tk)
+{
+	const auto name = tk.value();
+	if (name[0] == '.') {
+		auto it = m_scope.names.find(name);
+		if (it != m_scope.names.end()) return it->second;
+		const symbol_id id = m_symbols.add_local(name);
+		m_scope.names.emplace(m_symbols.name(id), id);
+		return id;
+	}
+	const auto number = name.substr(0, name.size() - 1);
+	if (name.back() == 'b') {
+		auto it = m_scope.previous.find(number);
+		if (it == m_scope.previous.end())
+			token_exception(tk, "No local label " + std::string(number) + " before this");
+		return it->second;
+	}
+	auto it = m_scope.next.find(number);
+	if (it != m_scope.next.end()) return it->second;
+	const symbol_id id = m_symbols.add_local(number);
+	m_scope.next.emplace(m_symbols.name(id), id);
+	return id;
+}
+void Assembler::close_scope()
+{
+	m_scope.names.clear();
+	m_scope.previous.clear();
+	m_scope.next.clear();
+}
+
+static size_t data_width(const PseudoOp* op)
+{
+	if (op == &PseudoOps::DATA_8 || op == &PseudoOps::RESV_8) return 1;
+	if (op == &PseudoOps::DATA_16 || op == &PseudoOps::RESV_16) return 2;
+	if (op == &PseudoOps::DATA_32 || op == &PseudoOps::RESV_32) return 4;
+	if (op == &PseudoOps::DATA_64 || op == &PseudoOps::RESV_64) return 8;
+	if (op == &PseudoOps::DATA_128 || op == &PseudoOps::RESV_128) return 16;
+	return 0;
+}
+static size_t data_width(std::string_view directive)
+{
+	if (directive == ".byte") return 1;
+	if (directive == ".half") return 2;
+	if (directive == ".word") return 4;
+	if (directive == ".dword" || directive == ".quad") return 8;
+	if (directive == ".octa") return 16;
+	return 0;
+}
+
+/* Estimates how much each section will grow from a token stream, so
+   that sections are sized up front instead of growing step by step.
+   Only what the tokens alone tell is counted: four bytes for each
+   instruction, and data and reservations with constant operands. */
+void Assembler::presize(const TokenStream& tv)
+{
+	std::string_view section = current_section().name();
+	size_t bytes = 0;
+	/* The number of constants on the line after token i */
+	auto constants_after = [&tv] (size_t i) -> size_t {
+		size_t n = 0;
+		const uint32_t line = tv[i].line();
+		while (i + 1 + n < tv.size() && tv[i + 1 + n].type() == TK_CONSTANT
+			&& tv[i + 1 + n].line() == line) n++;
+		return n;
+	};
+	auto next_is = [&tv] (size_t i, TokenType tt) {
+		return i + 1 < tv.size() && tv[i + 1].type() == tt;
+	};
+
+	for (size_t i = 0; i < tv.size(); i++) {
+		const auto tk = tv[i];
+		if (tk.type() == TK_OPCODE) {
+			bytes += 4;
+		} else if (tk.type() == TK_PSEUDOOP) {
+			const auto* op = tk.pseudoop();
+			const size_t width = data_width(op);
+			if (op == &PseudoOps::RESV_8 || op == &PseudoOps::RESV_16
+				|| op == &PseudoOps::RESV_32 || op == &PseudoOps::RESV_64
+				|| op == &PseudoOps::RESV_128) {
+				if (next_is(i, TK_CONSTANT))
+					bytes += tv[i + 1].u64() * width;
+			} else {
+				bytes += constants_after(i) * width;
+			}
+		} else if (tk.type() == TK_DIRECTIVE) {
+			const auto dir = tk.value();
+			if (dir == ".section" && next_is(i, TK_DIRECTIVE)) {
+				this->estimate(section, bytes);
+				section = tv[i + 1].value();
+				bytes = 0;
+			} else if (const size_t width = data_width(dir)) {
+				bytes += constants_after(i) * width;
+			} else if ((dir == ".string" || dir == ".ascii") && next_is(i, TK_STRING)) {
+				bytes += tv[i + 1].value().size() + (dir == ".string");
+			} else if (dir == ".fill" && next_is(i, TK_CONSTANT)) {
+				const size_t n = constants_after(i);
+				const uint64_t count = tv[i + 1].u64();
+				const uint64_t size = (n >= 2) ? tv[i + 2].u64() : 1;
+				/* Fills that are too large are reported by fill() */
+				if (size >= 1 && size <= 16 && count <= MAX_FILL / size)
+					bytes += count * size;
+			}
+		}
+	}
+	this->estimate(section, bytes);
+}
+void Assembler::estimate(std::string_view name, size_t bytes)
+{
+	if (bytes == 0) return;
+	auto it = m_section_index.find(name);
+	if (it != m_section_index.end())
+		m_sections[it->second].reserve(bytes);
+	else /* Reserved once the section appears */
+		m_estimates[std::string(name)] += bytes;
+}
+
+void Assembler::assemble_tokens()
+{
 	assert((options.base & 0xF) == 0);
 
 	while (!this->done())
 	{
-		auto& token = this->next();
-		switch (token.type) {
+		const auto token = this->next();
+		switch (token.type()) {
 		case TK_DIRECTIVE:
 			this->directive(token);
 			break;
 		case TK_LABEL:
-			current_section().add_label_soon(token.value);
+			current_section().add_label_soon(token.symbol() != SymbolTable::NONE
+				? token.symbol() : bind_label(token));
+			break;
+		case TK_OPCODE:
+			this->encode(token);
 			break;
-		case TK_OPCODE: {
-				align_with_labels(4);
-				auto il = token.opcode->handler(*this);
-				for (auto instr : il) {
-					add_output(OT_CODE, instr.raw, instr.length());
-				}
-			} break;
 		case TK_PSEUDOOP:
-			token.pseudoop->handler(*this);
+			token.pseudoop()->handler(*this, token);
 			break;
-		case TK_STRING:
 		case TK_SYMBOL:
+			if (auto* macro = find_macro(token.value())) {
+				this->expand_macro(*macro, token);
+				break;
+			}
+			[[fallthrough]];
+		case TK_STRING:
 		case TK_REGISTER:
 		case TK_CONSTANT:
 		case TK_OPERATOR:
 		case TK_UNSPEC:
 			fprintf(stderr, "Unexpected token %s at line %u\n",
-				token.to_string().c_str(), token.line);
+				token.to_string().c_str(), token.line());
 			throw std::runtime_error("Unexpected token: " + token.to_string());
 		}
 	}
-	/* Restore any previous assembler operation. */
-	this->tokens = prev_tokens;
-	this->index = prev_index;
-	this->m_realpath = prev_rpath;
 }
 void Assembler::finish()
 {
 	/* Output any remaining unattached labels. */
-	for (auto& sit : sections()) {
-		sit.second.align_with_labels(*this, 1);
+	for (auto& section : m_sections) {
+		section.align_with_labels(*this, 1);
 	}
+	this->define_global_pointer();
 	/* Calculate addresses for each section in the
 	   order they appear, unless the section has
 	   a custom base address. */
 	this->resolve_base_addresses();
-	/* Resolve addresses, sizes, custom symbol data. */
-	this->finish_scheduled_work();
+	/* Every label has its address now, so the instructions
+	   left by the layout can be encoded and resolved, unless
+	   some branch or jump is out of reach. Then everything is
+	   recorded, and relaxation moves what comes after them. */
+	if (!this->in_reach() || !this->encode_pending(true))
+		this->encode_pending(false);
+	this->relax();
+	/* Resolve addresses, sizes, custom symbol data. Without
+	   instructions, only sizes and types of symbols are missing. */
+	this->finish_relocations(options.layout_only);
 }
 
-void Assembler::resolve_base_addresses()
+/* Growth is what relaxation adds to each section, when it is
+   trying out a layout. See relax.cpp */
+void Assembler::resolve_base_addresses(const std::vector<int64_t>& growth)
 {
 	#define PAGE_REALIGN(base_addr) \
 		base_addr = (base_addr + 0xFFF) & ~(address_t)0xFFF
-	auto section_at = [this] (int idx) -> Section& {
-		for (auto& it : m_sections) {
-			if (it.second.index() == idx) return it.second;
-		}
-		throw std::runtime_error("Could not find section index " + std::to_string(idx));
-	};
 	address_t base_addr = options.base;
 	bool was_executable = false;
 	bool was_readonly = false;
-	for (size_t idx = 0; idx < m_sections.size(); idx++)
+	for (auto& section : m_sections)
 	{
-		auto& section = section_at(idx);
 		if (!section.has_base_address()) {
 			if (options.section_attr_page_separation) {
 				/* Page-realign when going from executable to
@@ -100,12 +338,13 @@ void Assembler::resolve_base_addresses()
 					PAGE_REALIGN(base_addr);
 				}
 			}
-			section.set_base_address(base_addr);
+			section.place_at(base_addr);
 		} else {
 			base_addr = section.base_address();
 			was_executable = section.code;
 		}
 		base_addr += section.size();
+		if (!growth.empty()) base_addr += growth[section.index()];
 		/* XXX: Alignment? */
 		base_addr = (base_addr + 0xF) & ~(address_t)0xF;
 	}
@@ -115,17 +354,22 @@ Instruction& Assembler::instruction_at(SymbolLocation loc, size_t off) {
 	return at_location<Instruction>(loc, off);
 }
 
-Section& Assembler::section(const std::string& name) {
-	auto it = m_sections.find(name);
-	if (it != m_sections.end()) return it->second;
+Section& Assembler::section(std::string_view name) {
+	auto it = m_section_index.find(name);
+	if (it != m_section_index.end()) return m_sections[it->second];
 
 	const int index = m_sections.size();
-	m_sections.emplace(std::piecewise_construct,
-		std::forward_as_tuple(name),
-		std::forward_as_tuple(name, index));
-	return m_sections.at(name);
+	auto& section = m_sections.emplace_back(std::string(name), index);
+	/* The key is a view of the name the section owns */
+	m_section_index.emplace(section.name(), index);
+	auto est = m_estimates.find(name);
+	if (est != m_estimates.end()) {
+		section.reserve(est->second);
+		m_estimates.erase(est);
+	}
+	return section;
 }
-void Assembler::set_section(const std::string& name) {
+void Assembler::set_section(std::string_view name) {
 	auto& sect = this->section(name);
 	this->m_current_section = &sect;
 }
@@ -136,185 +380,54 @@ void Assembler::add_output(OutputType ot, const void* vdata, size_t len) {
 void Assembler::allocate(size_t len) {
 	current_section().allocate(len);
 }
-void Assembler::align_with_labels(size_t alignment) {
-	current_section().align_with_labels(*this, alignment);
-}
 
 bool Assembler::symbol_is_known(const Token& tk) const
 {
-	return m_lookup.find(tk.value) != m_lookup.end();
+	return m_symbols.is_defined(tk.symbol());
 }
-void Assembler::add_symbol_here(const std::string& name) {
-	m_lookup.emplace(std::piecewise_construct,
-		std::forward_as_tuple(name),
-		std::forward_as_tuple(
-			SymbolLocation{m_current_section, m_current_section->size()}));
+void Assembler::add_symbol_here(symbol_id id) {
+	if (!m_symbols.define(id, SymbolLocation{m_current_section, m_current_section->size()}))
+		throw std::runtime_error("Label defined twice: " + std::string(m_symbols.name(id)));
 }
 address_t Assembler::address_of(const std::string& name) const
 {
-	auto it = m_lookup.find(name);
-	if (it != m_lookup.end())
-		return it->second.address();
+	const auto id = m_symbols.find(name);
+	if (id != SymbolTable::NONE && m_symbols.is_defined(id))
+		return m_symbols.location(id).address();
 
 	throw std::runtime_error("No such symbol: " + name);
 }
 address_t Assembler::address_of(const Token& tk) const
 {
-	auto it = m_lookup.find(tk.value);
-	if (it != m_lookup.end())
-		return it->second.address();
+	if (m_symbols.is_defined(tk.symbol()))
+		return m_symbols.location(tk.symbol()).address();
 
 	token_exception(tk, "resolve symbol");
 }
 
-void Assembler::schedule(const Token& tk, scheduled_op_t op)
-{
-	const auto& sym = tk.value;
-	m_schedule[sym].push_back(std::move(op));
-}
-void Assembler::schedule(const std::string& sym, scheduled_op_t op)
-{
-	m_schedule[sym].push_back(std::move(op));
-}
-void Assembler::finish_scheduled_work()
-{
-	for (auto& it : m_schedule) {
-		const auto& name = it.first;
-		auto sit = m_lookup.find(name);
-		if (sit != m_lookup.end()) {
-			for (auto& op : it.second)
-				op(*this, sit->first, sit->second);
-		} else {
-			throw std::runtime_error("Unknown symbol scheduled: " + name);
-		}
-	}
-}
-
-void Assembler::symbol_set_type(const std::string& name, uint32_t type)
+void Assembler::symbol_set_type(const Token& tk, uint32_t type)
 {
-	schedule(name,
-	[type] (Assembler&, auto&, SymbolLocation& sym) {
-		sym.type = type;
-	});
+	this->relocate(R_TYPE, tk, type);
 }
-void Assembler::make_global(const std::string& name)
+void Assembler::make_global(const Token& tk)
 {
-	m_globals.insert(name);
+	if (tk.symbol() == SymbolTable::NONE)
+		token_exception(tk, "Local labels cannot be global");
+	m_symbols.make_global(tk.symbol());
 }
 
-Token Assembler::resolve_constants()
-{
-	auto& imm = this->next <TK_CONSTANT> ();
-	Token sum {imm};
-	enum {
-		NONE,
-		ADD,
-		SUB,
-		MUL,
-		DIV,
-		SHR,
-		SHL,
-		MOD,
-		AND,
-		OR,
-		XOR,
-	} ops {NONE};
-
-	bool is_negated = false;
-
-	while (next_is(TK_CONSTANT) || next_is(TK_OPERATOR)) {
-		if (next_is(TK_CONSTANT)) {
-			auto& tk = next <TK_CONSTANT> ();
-
-			auto value = tk.u128;
-			if (is_negated) {
-				is_negated = false;
-				value = ~value;
-			}
-
-			switch (ops) {
-			case ADD:
-				sum.u128 = sum.u128 + value;
-				break;
-			case SUB:
-				sum.u128 = sum.u128 - value;
-				break;
-			case MUL:
-				sum.u128 = sum.u128 * value;
-				break;
-			case DIV:
-				sum.u128 = sum.u128 / value;
-				break;
-			case SHR:
-				sum.u128 = sum.u128 >> value;
-				break;
-			case SHL:
-				sum.u128 = sum.u128 << value;
-				break;
-			case MOD:
-				sum.u128 = sum.u128 % value;
-				break;
-			case AND:
-				sum.u128 = sum.u128 & value;
-				break;
-			case OR:
-				sum.u128 = sum.u128 | value;
-				break;
-			case XOR:
-				sum.u128 = sum.u128 ^ value;
-				break;
-			case NONE:
-			default:
-				token_exception(tk, "Unexpected constant");
-				break;
-			}
-		} else if (next_is(TK_OPERATOR)) {
-			auto& tk = next <TK_OPERATOR> ();
-			if (tk.value == "~") {
-				is_negated = !is_negated;
-			} else {
-				if (ops != NONE)
-					token_exception(tk, "Unexpected operator");
-				if (tk.value == "+")
-					ops = ADD;
-				else if (tk.value == "-")
-					ops = SUB;
-				else if (tk.value == "*")
-					ops = MUL;
-				else if (tk.value == "/")
-					ops = DIV;
-				else if (tk.value == ">>")
-					ops = SHR;
-				else if (tk.value == "<<")
-					ops = SHL;
-				else if (tk.value == "%")
-					ops = MOD;
-				else if (tk.value == "&")
-					ops = AND;
-				else if (tk.value == "|")
-					ops = OR;
-				else if (tk.value == "^")
-					ops = XOR;
-				else token_exception(tk,
-					"Unknown operator: " + tk.value);
-			}
-		}
-	}
-
-	return sum;
-}
 void Assembler::token_exception(const Token& tk, const std::string& info) const
 {
-	fprintf(stderr, "*** Problem on line %u: %s\n", tk.line, info.c_str());
+	print_problem(m_file, tk.line(), info);
 	throw std::runtime_error("Token: " + tk.to_string());
 }
-void Assembler::argument_mismatch(const Token& tk, TokenType T, const std::string& info) const
+void Assembler::argument_mismatch(const Token& tk, TokenType T, const char* info) const
 {
 	if (T == TK_REGISTER) {
 		Registers::print_all();
 	}
 	token_exception(tk,
 		"Argument mismatch. Expected " + Token::to_string(T)
-		+ ", found " + Token::to_string(tk.type) + " instead."
+		+ ", found " + Token::to_string(tk.type()) + " instead."
 		+ info);
 }
@@ -1,9 +1,15 @@
 #pragma once
+#include "conditional.hpp"
+#include "macro.hpp"
+#include "relocation.hpp"
 #include "section.hpp"
-#include <functional>
+#include "source.hpp"
+#include "stream.hpp"
+#include "symbols.hpp"
+#include <deque>
 #include <map>
+#include <tuple>
 #include <unordered_map>
-#include <set>
 #include <stdexcept>
 
 struct Options {
@@ -11,48 +17,81 @@ struct Options {
 	std::string entry = "_start";
 	bool section_attr_page_separation = true;
 	bool verbose_labels = false;
+	bool verbose_relocations = false;
+	/* Print section statistics, from --stats */
+	bool stats = false;
+	/* Only lay out sections and symbols, and write a map of them
+	   instead of the ELF, from --layout-only */
+	bool layout_only = false;
+	/* Sequences that addresses may take, from -mcmodel= */
+	CodeModel code_model = CM_ANY;
+	bool verbose_tokens = false;
+	/* Names for .if and .ifdef, from -D on the command line */
+	Conditionals::defines_t defines;
+	/* Directories to search for includes, from -I */
+	std::vector<std::string> include_dirs;
+	/* The input files in command-line order, named in diagnostics
+	   when there is more than one */
+	std::vector<std::string> files;
 };
 
 struct Assembler
 {
-	using scheduled_op_t = std::function<void(Assembler&, const std::string&, SymbolLocation&)>;
-
-	static std::vector<Token> split(const std::string&);
-	static Token parse(const RawToken&);
-
-	void assemble(const std::vector<Token>&, const char* rpath);
+	static TokenStream split(std::string_view, StringArena&, uint32_t line = 1);
+	/* Lex and append to an existing token stream. */
+	static void split(TokenStream&, std::string_view, StringArena&, uint32_t line);
+	static void parse(TokenStream&, const RawToken&);
+
+	/* Instructions from lasting token streams are encoded in finish(). */
+	void assemble(const TokenStream&, const char* rpath, bool lasting = false);
+	/* Assemble a file, relative to the file being assembled. */
+	void assemble_file(const std::string& filename);
+	/* Assemble batches as they arrive from a stream reader. */
+	void assemble(TokenQueue&, const char* rpath);
+	/* Append what another file was assembled into, see merge.cpp */
+	void merge(Assembler& part);
 	void finish();
 
-	const Token& next() {
-		return tokens->at(index++);
+	Token next() {
+		if (index >= tokens->size() && !refill()) {
+			[[unlikely]];
+			throw std::runtime_error("Unexpected end of input");
+		}
+		return (*tokens)[index++];
 	}
 	template <TokenType T>
-	const Token& next(const std::string& info = "") {
-		const auto& tk = next();
-		if (tk.type != T) {
+	Token next(const char* info = "") {
+		const auto tk = next();
+		if (tk.type() != T) {
 			argument_mismatch(tk, T, info);
 		}
 		return tk;
 	}
-	bool next_is(TokenType tt) const {
+	bool next_is(TokenType tt) {
 		if (done()) return false;
-		return tokens->at(index).type == tt;
+		return (*tokens)[index].type() == tt;
+	}
+	/* True when the next token is on the given line. */
+	bool next_on_line(uint32_t line) {
+		return !done() && (*tokens)[index].line() == line;
 	}
-	Token resolve_constants();
-	bool done() const noexcept { return index >= tokens->size(); }
+	Constant resolve_constants();
+	bool done() { return index >= tokens->size() && !refill(); }
 
 	bool is_aligned(size_t alignment) {
 		return (current_section().size() & (alignment-1)) == 0;
 	}
 	void align(size_t alignment) { current_section().align(alignment); }
-	void align_with_labels(size_t alignment);
+	void align_with_labels(size_t alignment) {
+		current_section().align_with_labels(*this, alignment);
+	}
 
 	void add_output(OutputType, const void* vdata, size_t len);
 	void allocate(size_t len);
 
 	auto& sections() noexcept { return m_sections; }
-	void set_section(const std::string&);
-	Section& section(const std::string&);
+	void set_section(std::string_view);
+	Section& section(std::string_view);
 	Section& current_section() noexcept { return *m_current_section; }
 	const Section& current_section() const noexcept { return *m_current_section; }
 	SymbolLocation current_location() const noexcept { return m_current_section->current_location(); }
@@ -60,40 +99,146 @@ struct Assembler
 	bool symbol_is_known(const Token&) const;
 	address_t address_of(const Token&) const;
 	address_t address_of(const std::string&) const;
-	void schedule(const std::string&, scheduled_op_t);
-	void schedule(const Token&, scheduled_op_t);
+	/* Fix up the current location once the symbol has an address. */
+	void relocate(RelocationKind, const Token& symbol, int32_t addend = 0);
+	const auto& relocations() const noexcept { return m_relocations; }
 
 	void directive(const Token&);
-	void add_symbol_here(const std::string& name);
-	const auto& symbols() const noexcept { return m_lookup; }
-	void make_global(const std::string& name);
-	void symbol_set_type(const std::string& name, uint32_t type);
-	const auto& globals() const noexcept { return m_globals; }
-	void add_label_soon(const std::string& name);
+	void define_macro(const Token& directive);
+	Macro* find_macro(std::string_view name);
+	void expand_macro(Macro&, const Token& name);
+	void repeat(const Token& directive);
+	void data_list(const Token& directive, size_t size);
+	/* Sections are held in memory, so a fill is at most 4 GiB */
+	static constexpr uint64_t MAX_FILL = 1ull << 32;
+	void fill(const Token& directive);
+	void add_symbol_here(symbol_id);
+	const SymbolTable& symbols() const noexcept { return m_symbols; }
+	void make_global(const Token&);
+	void symbol_set_type(const Token&, uint32_t type);
 
 	template <typename T>
 	T& at_location(SymbolLocation, size_t off = 0);
 	Instruction& instruction_at(SymbolLocation, size_t off = 0);
+	/* Where the relocation is, and gp, for reaching the target */
+	Reach reach_of(const Relocation&, address_t target) const;
 
 	[[noreturn]] void token_exception(const Token&, const std::string&) const;
-	[[noreturn]] void argument_mismatch(const Token&, TokenType, const std::string&) const;
+	[[noreturn]] void argument_mismatch(const Token&, TokenType, const char* info) const;
 
-	Assembler(const Options& opt);
+	/* Sources may be shared with the assemblers of other files */
+	/* File is the index of the input file in options.files */
+	Assembler(const Options& opt, Sources& sources, uint32_t file = 0);
 	const Options& options;
 	const char* realpath() const noexcept { return m_realpath; }
+	Sources& sources() noexcept { return m_sources; }
 private:
-	void resolve_base_addresses();
-	void finish_scheduled_work();
-
-	const std::vector<Token>* tokens = nullptr;
+	/* Instructions from a lasting token stream, one after another in
+	   a section, that are encoded once the layout is done. Labels
+	   may be in between them, but nothing else. */
+	struct PendingRun {
+		const TokenStream* tokens;
+		Section* section;
+		uint64_t offset;     /* Of the first instruction */
+		uint32_t begin, end; /* Tokens */
+		uint32_t lengths;    /* First in m_lengths */
+		uint32_t locals;     /* First in m_local_ids */
+		uint32_t size;       /* Bytes */
+		uint32_t count;      /* Instructions */
+	};
+	void assemble_tokens();
+	void encode(const Token& opcode);
+	size_t encode_now(const Opcode&, const symbol_id* locals);
+	size_t bind_locals(size_t begin, size_t end);
+	symbol_id bind_label(const Token&);
+	symbol_id bind_reference(const Token&);
+	void close_scope();
+	void encode_run(const PendingRun&, std::vector<Relocation>&,
+		std::vector<uint8_t>& programs, uint32_t& line) const;
+	bool encode_pending(bool resolve_now);
+	bool refill();
+	void intern_symbols(TokenStream&);
+	void presize(const TokenStream&);
+	void estimate(std::string_view section, size_t bytes);
+	void record_body(TokenStream&, std::string_view begin, std::string_view end, const Token& start);
+	void resolve_base_addresses(const std::vector<int64_t>& growth = {});
+	void define_global_pointer();
+	bool reaches(const Relocation&, const uint8_t* programs) const;
+	bool in_reach() const;
+	bool run_in_reach(const PendingRun&) const;
+	void relax();
+	void finish_relocations(bool symbols_only = false);
+	void resolve(const Relocation&, const uint8_t* programs);
+
+	/* Problems found in parallel, which are reported in order of file
+	   and line once they are all found. */
+	struct Problem {
+		uint32_t file;
+		uint32_t line;
+		size_t index;
+		std::string what;
+		bool reported = false; /* Printed when it was found */
+		bool operator< (const Problem& other) const {
+			return std::tie(file, line, index)
+				< std::tie(other.file, other.line, other.index);
+		}
+	};
+	[[noreturn]] void report(std::vector<Problem>&) const;
+	void print_problem(uint32_t file, uint32_t line, const std::string& info) const;
+	void print_warning(uint32_t file, uint32_t line, const std::string& info) const;
+	/* The input file that relocation i came from */
+	uint32_t file_of(size_t relocation) const;
+
+	const TokenStream* tokens = nullptr;
 	size_t index = 0;
+	TokenQueue* m_stream = nullptr;
+	bool m_lasting = false;
+	std::unique_ptr<TokenBatch> m_batch;
+	std::unique_ptr<TokenBatch> m_prev_batch;
 
 	Section* m_current_section = nullptr;
-	std::map<std::string, Section> m_sections;
-	std::unordered_map<std::string, SymbolLocation> m_lookup;
-	std::map<std::string, std::vector<scheduled_op_t>> m_schedule;
-	std::set<std::string> m_globals;
-	const char* m_realpath;
+	/* Sections in the order they appear, which is their index. They
+	   stay in place as the deque grows, as locations point to them. */
+	std::deque<Section> m_sections;
+	std::unordered_map<std::string_view, int> m_section_index;
+	/* Estimated sizes of sections that don't exist yet */
+	std::map<std::string, size_t, std::less<>> m_estimates;
+	SymbolTable m_symbols;
+	/* __global_pointer$, when the program uses it to set up gp */
+	symbol_id m_global_pointer = SymbolTable::NONE;
+	/* Pending work on symbols, in program order */
+	std::vector<Relocation> m_relocations;
+	/* Bytecode of expressions, see expression.hpp */
+	std::vector<uint8_t> m_programs;
+	std::vector<PendingRun> m_runs;
+	/* Lengths of the instructions in runs that were encoded
+	   during layout, as their size depends on their operands */
+	std::vector<uint8_t> m_lengths;
+	/* Local labels used by instructions in runs, in token order */
+	std::vector<symbol_id> m_local_ids;
+	/* Numeric labels (1: with 1b and 1f) and .L labels, from the
+	   end of the previous function to the next .endfunc. Keys are
+	   names owned by the symbol table. */
+	struct LocalScope {
+		std::unordered_map<std::string_view, symbol_id> names;
+		std::unordered_map<std::string_view, symbol_id> previous;
+		std::unordered_map<std::string_view, symbol_id> next;
+	} m_scope;
+	std::map<std::string, Macro, std::less<>> m_macros;
+	const char* m_realpath = nullptr;
+	Sources& m_sources;
+	const uint32_t m_file;
+	/* Merged relocations, from m_relocations[first] on, are from file */
+	struct FileRange {
+		size_t first;
+		uint32_t file;
+	};
+	std::vector<FileRange> m_file_ranges;
+	/* Files lexed by the assembler of another input file, with the
+	   symbols interned again, into this one's symbol table */
+	std::unordered_map<const SourceFile*, TokenStream> m_interned;
+	/* Text of tokens made by macros */
+	StringArena m_arena;
 };
 
 template <typename T>
@@ -0,0 +1,232 @@
+#include "conditional.hpp"
+#include "assembler.hpp"
+#include "expression.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+static bool is_blank(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+static bool is_word_char(char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+		|| (c >= '0' && c <= '9') || c == '_' || c == '.' || c == '$';
+}
+
+/* .if expressions are lexed and parsed like those of instructions.
+   Names are the ones defined on the command line. */
+struct ConditionalParser : ExprParser {
+	ConditionalParser(const TokenStream& tokens, const Conditionals::defines_t& d)
+		: ExprParser(tokens, 0, tokens.size()), defines(d) {}
+private:
+	__uint128_t name(const Token& tk, ExprCode& code) override {
+		switch (tk.type()) {
+		case TK_SYMBOL:
+		case TK_REGISTER:
+		case TK_OPCODE:
+		case TK_PSEUDOOP:
+			break;
+		default:
+			error(tk, "Unexpected '" + std::string(tk.value()) + "'");
+		}
+		auto it = defines.find(tk.value());
+		if (it == defines.end())
+			error(tk, "Undefined name " + std::string(tk.value()));
+		code.constant(it->second);
+		return it->second;
+	}
+	[[noreturn]] void error(const Token&, const std::string& info) const override {
+		throw std::runtime_error(info);
+	}
+
+	const Conditionals::defines_t& defines;
+};
+
+Conditionals::Directive Conditionals::directive_at(const char* p, const char* end, const char*& word_end)
+{
+	const char* begin = p;
+	while (p < end && is_word_char(*p)) p++;
+	word_end = p;
+	/* Directives are followed by a blank, a comment or the end of the line */
+	if (p < end && !is_blank(*p) && *p != '\n' && *p != ';')
+		return NONE;
+	const std::string_view word {begin, size_t(p - begin)};
+	if (word == ".if") return IF;
+	if (word == ".ifdef") return IFDEF;
+	if (word == ".ifndef") return IFNDEF;
+	if (word == ".else") return ELSE;
+	if (word == ".endif") return ENDIF;
+	return NONE;
+}
+
+/* Skips lines until the branch ends, and returns the position
+   after the line that ended it, or the end of s. */
+size_t Conditionals::skip(std::string_view s, size_t pos, uint32_t& line)
+{
+	const char* data = s.data();
+	const char* end = data + s.size();
+	while (pos < s.size())
+	{
+		const char* p = data + pos;
+		while (p < end && is_blank(*p)) p++;
+		const char* nl = (const char *)memchr(data + pos, '\n', s.size() - pos);
+		const size_t next = (nl != nullptr) ? nl - data + 1 : s.size();
+
+		if (p < end && *p == '.') {
+			const char* word_end;
+			switch (directive_at(p, end, word_end)) {
+			case IF:
+			case IFDEF:
+			case IFNDEF:
+				m_skip_depth++;
+				break;
+			case ELSE:
+				if (m_skip_depth == 0) {
+					auto& level = m_levels.back();
+					if (level.seen_else)
+						throw std::runtime_error("Duplicate .else on line " + std::to_string(line));
+					level.seen_else = true;
+					if (!level.taken) {
+						level.taken = true;
+						m_skipping = false;
+						line += (nl != nullptr);
+						return next;
+					}
+				}
+				break;
+			case ENDIF:
+				if (m_skip_depth == 0) {
+					m_levels.pop_back();
+					m_skipping = false;
+					line += (nl != nullptr);
+					return next;
+				}
+				m_skip_depth--;
+				break;
+			case NONE:
+				break;
+			}
+		}
+		line += (nl != nullptr);
+		pos = next;
+	}
+	return pos;
+}
+
+bool Conditionals::evaluate(Directive dir, std::string_view args, uint32_t line, StringArena& arena) const
+{
+	/* Trim blanks and comments */
+	args = args.substr(0, std::min(args.find(';'), args.size()));
+	while (!args.empty() && is_blank(args.front())) args.remove_prefix(1);
+	while (!args.empty() && is_blank(args.back())) args.remove_suffix(1);
+	if (dir == IF) {
+		try {
+			const TokenStream tokens = Assembler::split(args, arena, line);
+			if (tokens.empty())
+				throw std::runtime_error("Missing operand");
+			ConditionalParser parser {tokens, m_defines};
+			ExprCode code;
+			const __uint128_t value = parser.parse(code);
+			if (!parser.done())
+				throw std::runtime_error("Unexpected '"
+					+ std::string(tokens[parser.position()].value()) + "'");
+			return value != 0;
+		} catch (const std::exception& e) {
+			throw std::runtime_error("Invalid .if expression on line "
+				+ std::to_string(line) + ": " + e.what());
+		}
+	}
+	if (args.empty())
+		throw std::runtime_error("Missing name for .ifdef on line " + std::to_string(line));
+	const bool defined = m_defines.find(args) != m_defines.end();
+	return (dir == IFDEF) ? defined : !defined;
+}
+
+void Conditionals::split(TokenStream& tokens, std::string_view s, StringArena& arena, uint32_t line)
+{
+	const char* data = s.data();
+	const char* end = data + s.size();
+	size_t pos = 0;
+	if (m_skipping)
+		pos = skip(s, pos, line);
+
+	size_t search = pos;
+	while (pos < s.size())
+	{
+		/* Find the next conditional directive that starts a line. */
+		const char* dot = (const char *)memchr(data + search, '.', s.size() - search);
+		if (dot == nullptr || dot + 1 >= end) {
+			Assembler::split(tokens, s.substr(pos), arena, line);
+			return;
+		}
+		search = dot - data + 1;
+		if (dot[1] != 'i' && dot[1] != 'e')
+			continue;
+		const char* begin = dot;
+		while (begin > data + pos && is_blank(begin[-1])) begin--;
+		if (begin > data && begin[-1] != '\n')
+			continue;
+		const char* word_end;
+		const Directive dir = directive_at(dot, end, word_end);
+		if (dir == NONE)
+			continue;
+
+		/* Lex everything before the directive line. */
+		const size_t line_begin = begin - data;
+		Assembler::split(tokens, s.substr(pos, line_begin - pos), arena, line);
+		line += std::count(data + pos, begin, '\n');
+
+		const char* nl = (const char *)memchr(word_end, '\n', end - word_end);
+		const char* line_end = (nl != nullptr) ? nl : end;
+		const std::string_view args {word_end, size_t(line_end - word_end)};
+		const uint32_t dir_line = line;
+		pos = (nl != nullptr) ? line_end - data + 1 : s.size();
+		line += (nl != nullptr);
+
+		switch (dir) {
+		case IF:
+		case IFDEF:
+		case IFNDEF: {
+			const bool taken = evaluate(dir, args, dir_line, arena);
+			m_levels.push_back({taken, false, dir_line});
+			if (!taken) {
+				m_skipping = true;
+				m_skip_depth = 0;
+				pos = skip(s, pos, line);
+			}
+			} break;
+		case ELSE:
+			if (m_levels.empty())
+				throw std::runtime_error(".else without .if on line " + std::to_string(dir_line));
+			if (m_levels.back().seen_else)
+				throw std::runtime_error("Duplicate .else on line " + std::to_string(dir_line));
+			/* The branch before was assembled, so skip this one. */
+			m_levels.back().seen_else = true;
+			m_skipping = true;
+			m_skip_depth = 0;
+			pos = skip(s, pos, line);
+			break;
+		case ENDIF:
+			if (m_levels.empty())
+				throw std::runtime_error(".endif without .if on line " + std::to_string(dir_line));
+			m_levels.pop_back();
+			break;
+		case NONE:
+			break;
+		}
+		search = pos;
+	}
+}
+TokenStream Conditionals::split(std::string_view s, StringArena& arena, uint32_t line)
+{
+	TokenStream tokens;
+	this->split(tokens, s, arena, line);
+	return tokens;
+}
+
+void Conditionals::finish() const
+{
+	if (!m_levels.empty())
+		throw std::runtime_error("Missing .endif for .if on line "
+			+ std::to_string(m_levels.back().line));
+}
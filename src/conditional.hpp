@@ -0,0 +1,38 @@
+#pragma once
+#include "source.hpp"
+#include "types.hpp"
+#include <map>
+
+/* Conditional assembly with .if, .ifdef, .ifndef, .else and .endif.
+   Conditionals are handled before lexing: the false branches are
+   skipped a line at a time, so they are never tokenized. Conditional
+   directives must be the first word on their line. The state carries
+   over between calls, so a source can be split in pieces, as long as
+   each piece ends at a line boundary. */
+struct Conditionals {
+	using defines_t = std::map<std::string, address_t, std::less<>>;
+
+	/* Lex the parts of s that are not skipped, appending to tokens. */
+	void split(TokenStream& tokens, std::string_view s, StringArena&, uint32_t line = 1);
+	TokenStream split(std::string_view s, StringArena&, uint32_t line = 1);
+	/* Verify that every conditional was closed. */
+	void finish() const;
+
+	Conditionals(const defines_t& defines) : m_defines(defines) {}
+private:
+	enum Directive { NONE, IF, IFDEF, IFNDEF, ELSE, ENDIF };
+	struct Level {
+		bool taken;     /* A branch has already been assembled */
+		bool seen_else;
+		uint32_t line;
+	};
+	static Directive directive_at(const char* p, const char* end, const char*& word_end);
+	size_t skip(std::string_view s, size_t pos, uint32_t& line);
+	bool evaluate(Directive, std::string_view args, uint32_t line, StringArena&) const;
+
+	const defines_t& m_defines;
+	std::vector<Level> m_levels;
+	bool m_skipping = false;
+	/* Nesting inside a skipped branch */
+	unsigned m_skip_depth = 0;
+};
@@ -0,0 +1,188 @@
+#include "opcodes.hpp"
+#include "instruction_list.hpp"
+
+/* Constants for set, built with as few instructions as possible, in
+   the spirit of RISCVMatInt from LLVM, but for 128-bit registers.
+
+   A value that fits in 32 bits is LUI + ADDIW, where ADDIW wraps
+   around for those just below 2^31. Anything else is built from the
+   value without its low 12 bits, which is shifted up to drop its
+   trailing zeroes, then shifted back and the low bits added:
+
+     0x12345678_00000123:  lui; addiw; slli; addi
+
+   The same is tried with the 64-bit SLLID and ADDID, which sign-extend
+   from bit 63, so that only the bits below it have to be built. Then
+   also with the leading zeroes shifted out, and back with SRLI, and
+   with the bits inverted, and inverted back with XORI:
+
+     0x00FFFFFF_FFFFFFFF:  addi -1; srli 72
+
+   With a temporary register, the value can also be split in two at a
+   multiple of 32 bits, where the upper part is built first, and the
+   lower part in the temporary, to be shifted and added together. A
+   value that repeats itself is built once, and added to itself shifted:
+
+     0x12345678_12345678:  lui; addiw; slli tmp, rd, 32; add
+
+   The shortest of all of them is used, and without the temporary when
+   that is just as short. */
+
+namespace {
+struct Sequence {
+	static constexpr unsigned CAPACITY = 24;
+
+	void push_back(Instruction instr) {
+		/* Longer sequences are never the shortest */
+		if (size < CAPACITY) list[size] = instr;
+		size++;
+	}
+	void append(const Sequence& other) {
+		for (unsigned i = 0; i < other.size && i < CAPACITY; i++)
+			push_back(other.list[i]);
+	}
+	Instruction list[CAPACITY];
+	unsigned size = 0;
+};
+}
+
+static constexpr unsigned REG_ZERO = 0;
+
+static bool fits(__int128 value, unsigned bits)
+{
+	const __int128 min = -((__int128)1 << (bits - 1));
+	return value >= min && value < -min;
+}
+/* The low bits of the value, sign-extended */
+static __int128 sext(__int128 value, unsigned bits)
+{
+	const unsigned shift = 128 - bits;
+	return (__int128)((unsigned __int128)value << shift) >> shift;
+}
+static unsigned trailing_zeroes(__int128 value)
+{
+	const uint64_t lo = value;
+	return lo ? __builtin_ctzll(lo) : 64 + __builtin_ctzll((uint64_t)(value >> 64));
+}
+static unsigned leading_zeroes(__int128 value)
+{
+	const uint64_t hi = (unsigned __int128)value >> 64;
+	return hi ? __builtin_clzll(hi) : 64 + __builtin_clzll((uint64_t)value);
+}
+
+static Instruction itype(uint32_t opcode, uint32_t funct3,
+	unsigned rd, unsigned rs1, int32_t imm)
+{
+	Instruction instr(opcode);
+	instr.Itype.rd = rd;
+	instr.Itype.funct3 = funct3;
+	instr.Itype.rs1 = rs1;
+	instr.Itype.imm = imm;
+	return instr;
+}
+
+/* Builds the value in rd alone. Shifting out leading zeroes and
+   inverting are only tried on the whole value. */
+static Sequence build_single(__int128 value, unsigned rd, bool whole)
+{
+	Sequence seq;
+	if (fits(value, 12)) {
+		seq.push_back(itype(RV32I_OP_IMM, 0x0, rd, REG_ZERO, value));
+		return seq;
+	}
+	if (fits(value, 32)) {
+		const int32_t lo = sext(value, 12);
+		Instruction lui(RV32I_LUI);
+		lui.Utype.rd = rd;
+		lui.Utype.imm = (value - lo) >> 12;
+		seq.push_back(lui);
+		if (lo != 0)
+			seq.push_back(itype(RV64I_OP_IMM32, 0x0, rd, rd, lo));
+		return seq;
+	}
+
+	/* Shift left, then add the low 12 bits, in 128 or 64 bits */
+	auto shifted = [&] (unsigned bits) {
+		const uint32_t opcode = (bits == 128) ? RV32I_OP_IMM : RV128I_OP_IMM64;
+		const int32_t lo = sext(value, 12);
+		const __int128 upper = sext((unsigned __int128)value - lo, bits);
+		unsigned shift = trailing_zeroes(upper);
+		__int128 rest = sext(upper >> shift, bits - shift);
+		/* Leave 12 zeroes for LUI, rather than building them */
+		if (shift > 12 && !fits(rest, 12) && fits(rest, 20)) {
+			shift -= 12;
+			rest *= 4096;
+		}
+		Sequence s = build_single(rest, rd, false);
+		s.push_back(itype(opcode, 0x1, rd, rd, shift));
+		if (lo != 0)
+			s.push_back(itype(opcode, 0x0, rd, rd, lo));
+		return s;
+	};
+	seq = shifted(128);
+	if (fits(value, 64)) {
+		Sequence s = shifted(64);
+		if (s.size < seq.size) seq = s;
+	}
+	if (!whole) return seq;
+
+	if (value > 0) {
+		/* Shift out the leading zeroes, and either fill in
+		   zeroes or ones from below, then shift back */
+		const unsigned shift = leading_zeroes(value);
+		const __int128 upper = (unsigned __int128)value << shift;
+		const __int128 ones = ((__int128)1 << shift) - 1;
+		for (const __int128 v : {upper, upper | ones}) {
+			Sequence s = build_single(v, rd, false);
+			s.push_back(itype(RV32I_OP_IMM, 0x5, rd, rd, shift));
+			if (s.size < seq.size) seq = s;
+		}
+	} else {
+		Sequence s = build_single(~value, rd, false);
+		s.push_back(itype(RV32I_OP_IMM, 0x4, rd, rd, -1));
+		if (s.size < seq.size) seq = s;
+	}
+	return seq;
+}
+
+/* Builds the value in rd, using tmp when that is shorter */
+static Sequence build_pair(__int128 value, unsigned rd, unsigned tmp)
+{
+	Sequence seq = build_single(value, rd, true);
+	if (seq.size <= 3) return seq;
+
+	Instruction add(RV32I_OP);
+	add.Rtype.rd = rd;
+	add.Rtype.rs1 = rd;
+	add.Rtype.rs2 = tmp;
+	for (unsigned shift = 1; shift < 128; shift++) {
+		const __int128 lower = sext(value, shift);
+		const __int128 upper = (__int128)((unsigned __int128)value - lower) >> shift;
+		if (upper == 0) break;
+		if (lower == 0) continue;
+		/* The same value above and below */
+		if (upper == sext(lower, 128 - shift)) {
+			Sequence s = build_pair(lower, rd, tmp);
+			s.push_back(itype(RV32I_OP_IMM, 0x1, tmp, rd, shift));
+			s.push_back(add);
+			if (s.size < seq.size) seq = s;
+		}
+		/* The upper part first, as it may use the temporary */
+		if (shift % 32 == 0) {
+			Sequence s = build_pair(upper, rd, tmp);
+			s.push_back(itype(RV32I_OP_IMM, 0x1, rd, rd, shift));
+			s.append(build_single(lower, tmp, true));
+			s.push_back(add);
+			if (s.size < seq.size) seq = s;
+		}
+	}
+	return seq;
+}
+
+void build_constant(InstructionList& res, unsigned rd, unsigned tmp, __int128 value)
+{
+	const Sequence seq = (tmp != rd && tmp != REG_ZERO)
+		? build_pair(value, rd, tmp) : build_single(value, rd, true);
+	for (unsigned i = 0; i < seq.size; i++)
+		res.push_back(seq.list[i]);
+}
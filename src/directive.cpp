@@ -1,94 +1,187 @@
 #include "assembler.hpp"
+#include "encoder.hpp"
+#include <algorithm>
+#include <cstring>
 #include <elf.h>
-extern std::string load_file(const std::string&, const char*);
-extern const char* get_realpath(const char* path);
 
 void Assembler::directive(const Token& token)
 {
-	if (token.value == ".align") {
-		this->align(next<TK_CONSTANT>().u64);
-	} else if (token.value == ".endfunc") {
-		const auto& sym = next<TK_SYMBOL>();
-		auto loc = current_location();
-
-		this->schedule(sym,
-		[loc] (Assembler&, const std::string&, auto& sym) {
-			sym.size = loc.address() - sym.address();
-			sym.type = STT_FUNC;
-		});
-	} else if (token.value == ".finish_labels") {
+	if (token.value() == ".align") {
+		this->align(next<TK_CONSTANT>().u64());
+	} else if (token.value() == ".endfunc") {
+		const auto sym = next<TK_SYMBOL>();
+		this->relocate(R_ENDFUNC, sym);
+		/* Local labels end with the function */
+		this->close_scope();
+	} else if (token.value() == ".finish_labels") {
 		this->align_with_labels(0);
-	} else if (token.value == ".global") {
-		const auto& sym = next<TK_SYMBOL>();
-		this->make_global(sym.value);
-	} else if (token.value == ".include") {
-		const auto& sym = next<TK_STRING>();
-		auto contents = load_file(sym.value, m_realpath);
-		auto tokens = Assembler::split(contents);
-		const char* rpath = get_realpath(sym.value.c_str());
-		this->assemble(tokens, rpath);
-	} else if (token.value == ".section") {
+	} else if (token.value() == ".global") {
+		const auto sym = next<TK_SYMBOL>();
+		this->make_global(sym);
+	} else if (token.value() == ".include") {
+		const auto sym = next<TK_STRING>();
+		this->assemble_file(std::string(sym.value()));
+	} else if (token.value() == ".section") {
 		/* Sections aren't really directives, but they do
 		   start with a . (dot), so use that for simplicity. */
-		const auto& section = next<TK_DIRECTIVE>();
-		this->set_section(section.value);
-	} else if (token.value == ".org") {
-		const auto& ba = next<TK_CONSTANT>();
+		const auto section = next<TK_DIRECTIVE>();
+		this->set_section(section.value());
+	} else if (token.value() == ".org") {
+		const auto ba = next<TK_CONSTANT>();
 		if (current_section().size() > 0)
 			throw std::runtime_error("Cannot change base address when instructions already generated");
-		current_section().set_base_address(ba.u128);
+		current_section().set_base_address(ba.u128());
 		printf("Base address: 0x%s\n",
 			to_hex_string(current_section().base_address()).c_str());
-	} else if (token.value == ".execonly") {
+	} else if (token.value() == ".execonly") {
 		current_section().make_execonly();
-	} else if (token.value == ".readonly") {
+	} else if (token.value() == ".readonly") {
 		current_section().make_readonly();
-	} else if (token.value == ".type") {
-		const auto& sym = next<TK_SYMBOL>();
-		const auto& info = next<TK_SYMBOL>();
-		if (info.value == "object") {
-			this->symbol_set_type(sym.value, STT_OBJECT);
-		} else if (info.value == "func" || info.value == "function") {
-			this->symbol_set_type(sym.value, STT_FUNC);
+	} else if (token.value() == ".type") {
+		const auto sym = next<TK_SYMBOL>();
+		const auto info = next<TK_SYMBOL>();
+		if (info.value() == "object") {
+			this->symbol_set_type(sym, STT_OBJECT);
+		} else if (info.value() == "func" || info.value() == "function") {
+			this->symbol_set_type(sym, STT_FUNC);
 		} else {
-			throw std::runtime_error("Unknown type: " + info.value);
+			throw std::runtime_error("Unknown type: " + std::string(info.value()));
 		}
-	} else if (token.value == ".size") {
-		const auto& sym = next<TK_SYMBOL>();
+	} else if (token.value() == ".size") {
+		const auto sym = next<TK_SYMBOL>();
 		const uint32_t size = 0;
-		auto dataloc = current_location();
+		const size_t dataend = current_section().size();
 		this->align_with_labels(alignof(decltype(size)));
-		auto loc = current_location();
 		const auto* src = (const uint8_t *)&size;
 
-		this->schedule(sym,
-		[loc, dataloc] (Assembler& a, const std::string&, auto& sym) {
-			auto& size = a.at_location<uint32_t>(loc);
-			if (sym.address() < dataloc.address())
-				size = dataloc.address() - sym.address(); /* NB: Opposite */
-			else
-				size = sym.address() - 4 - loc.address(); /* NB: Forward */
-			sym.size = size;
-		});
+		this->relocate(R_SIZE, sym, current_section().size() - dataend);
 		/* NOTE: We add a length of zero here, and fix
 		   the actual output later on when length is known. */
 		add_output(OT_DATA, src, sizeof(size));
 
-	} else if (token.value == ".string") {
-		const auto& str = next<TK_STRING>();
+	} else if (token.value() == ".string") {
+		const auto str = next<TK_STRING>().value();
 		this->align_with_labels(0);
-		/* We want the zero-termination */
-		add_output(OT_DATA, str.value.data(), str.value.size()+1);
-	} else if (token.value == ".strlen") {
-		const auto& str = next<TK_STRING>();
-		const uint32_t size = str.value.size();
+		/* We want the zero-termination, which isn't
+		   part of the view into the source file. */
+		const char zero = 0;
+		add_output(OT_DATA, str.data(), str.size());
+		add_output(OT_DATA, &zero, sizeof(zero));
+	} else if (token.value() == ".strlen") {
+		const auto str = next<TK_STRING>();
+		const uint32_t size = str.value().size();
 		this->align_with_labels(alignof(decltype(size)));
 		add_output(OT_DATA, &size, sizeof(size));
-	} else if (token.value == ".ascii") {
-		const auto& str = next<TK_STRING>();
+	} else if (token.value() == ".ascii") {
+		const auto str = next<TK_STRING>();
 		this->align_with_labels(0);
-		add_output(OT_DATA, str.value.data(), str.value.size());
+		add_output(OT_DATA, str.value().data(), str.value().size());
+	} else if (token.value() == ".byte") {
+		this->data_list(token, 1);
+	} else if (token.value() == ".half") {
+		this->data_list(token, 2);
+	} else if (token.value() == ".word") {
+		this->data_list(token, 4);
+	} else if (token.value() == ".dword" || token.value() == ".quad") {
+		this->data_list(token, 8);
+	} else if (token.value() == ".octa") {
+		this->data_list(token, 16);
+	} else if (token.value() == ".fill") {
+		this->fill(token);
+	} else if (token.value() == ".macro") {
+		this->define_macro(token);
+	} else if (token.value() == ".rept") {
+		this->repeat(token);
+	} else if (token.value() == ".endm" || token.value() == ".endr") {
+		token_exception(token, "Unexpected end of macro or repeat");
+	} else if (token.value() == ".if" || token.value() == ".ifdef"
+		|| token.value() == ".ifndef" || token.value() == ".else"
+		|| token.value() == ".endif") {
+		/* These are handled before lexing, see conditional.cpp */
+		token_exception(token, "Conditional directives must start a line");
 	} else {
-		fprintf(stderr, "Unknown directive: %s\n", token.value.c_str());
+		fprintf(stderr, "Unknown directive: %.*s\n",
+			(int)token.value().size(), token.value().data());
+	}
+}
+
+/* Values are the constants on the same line as the directive. They
+   are counted first, so that the output only grows once. Lines with
+   expressions are read one value at a time, and values that refer
+   to symbols are completed by relocations. */
+void Assembler::data_list(const Token& directive, size_t size)
+{
+	const uint32_t line = directive.line();
+	if (!next_on_line(line))
+		token_exception(directive, "Expected a list of values");
+	if (!next_is(TK_CONSTANT) && !next_is(TK_SYMBOL) && !next_is(TK_OPERATOR))
+		argument_mismatch(next(), TK_CONSTANT, " Expected a list of values.");
+	const auto& tv = *this->tokens;
+	size_t end = index;
+	while (end < tv.size() && tv[end].type() == TK_CONSTANT && tv[end].line() == line)
+		end++;
+	const size_t count = end - index;
+
+	this->align_with_labels(size);
+	if (end < tv.size() && tv[end].line() == line
+		&& (tv[end].type() == TK_SYMBOL || tv[end].type() == TK_OPERATOR)) {
+		const size_t last = Encoder::operands_end(tv, index, line);
+		const size_t locals = bind_locals(index, last);
+		Encoder enc(*this, tv, index, current_location(),
+			m_relocations, m_programs, m_local_ids.data() + locals);
+		while (!enc.done()) {
+			enc.move_to(current_section().size());
+			const auto value = enc.expression(R_DATA, size);
+			std::string problem;
+			if (!value.deferred && !data_fits(value.u128, size, problem))
+				token_exception(value.token, problem);
+			uint8_t* dst = current_section().extend(OT_DATA, size);
+			std::memcpy(dst, &value.u128, size);
+		}
+		m_local_ids.resize(locals);
+		this->index = enc.position();
+		return;
+	}
+	std::string problem;
+	for (size_t i = index; i < end; i++)
+		if (!data_fits(tv[i].u128(), size, problem))
+			token_exception(tv[i], problem);
+	uint8_t* dst = current_section().extend(OT_DATA, count * size);
+	for (size_t i = index; i < end; i++) {
+		const __uint128_t value = tv[i].u128();
+		std::memcpy(dst, &value, size);
+		dst += size;
+	}
+	this->index = end;
+}
+
+/* .fill count [, size [, value]] repeats value, size bytes wide */
+void Assembler::fill(const Token& directive)
+{
+	const uint64_t count = next<TK_CONSTANT>().u64();
+	uint64_t size = 1;
+	__uint128_t value = 0;
+	if (next_on_line(directive.line()))
+		size = next<TK_CONSTANT>().u64();
+	if (next_on_line(directive.line()))
+		value = next<TK_CONSTANT>().u128();
+	if (size == 0 || size > sizeof(value))
+		token_exception(directive, "Fill size must be between 1 and 16");
+	std::string problem;
+	if (!data_fits(value, size, problem))
+		token_exception(directive, problem);
+	if (count > MAX_FILL / size)
+		token_exception(directive, "Fill is larger than " + std::to_string(MAX_FILL) + " bytes");
+
+	this->align_with_labels(1);
+	uint8_t* dst = current_section().extend(OT_DATA, count * size);
+	if (value == 0 || count == 0) return;
+	/* Write one value, then keep doubling what has been written. */
+	std::memcpy(dst, &value, size);
+	const size_t total = count * size;
+	for (size_t done = size; done < total; ) {
+		const size_t len = std::min(done, total - done);
+		std::memcpy(dst + done, dst, len);
+		done += len;
 	}
 }
@@ -1,18 +1,28 @@
 #include "assembler.hpp"
-#include <map>
 extern bool file_writer(const std::string&, const std::vector<uint8_t>&);
 static constexpr bool VERBOSE_SECTIONS = true;
 
+/* This file is built once for each ELF class, so the helpers must not
+   be visible outside of it. */
+namespace {
+struct ElfData {
+	static inline constexpr size_t S = 3;
+	Elf_Ehdr hdr;
+	Elf_Shdr shdr[1 + S];
+	Elf_Phdr phdr[0];
+};
+
+/* Sections refer to their header by index, as the headers are part
+   of the output, and move whenever the output grows. */
 struct ElfStringSection {
-	Elf_Shdr& shdr;
 	std::vector<uint8_t>& bin;
-	std::map<std::string, size_t> namelist;
 	const int shindex;
 	size_t offset = 0;
 
-	ElfStringSection(Elf_Shdr& sh, int idx, std::vector<uint8_t>& b)
-		: shdr{sh}, bin{b}, shindex{idx}
+	ElfStringSection(int idx, std::vector<uint8_t>& b)
+		: bin{b}, shindex{idx}
 	{
+		auto& shdr = this->shdr();
 		shdr.sh_name = 0;
 		shdr.sh_type = SHT_STRTAB;
 		shdr.sh_flags = 0;
@@ -25,31 +35,32 @@ struct ElfStringSection {
 		this->append_null();
 	}
 
-	size_t add(const std::string& str) {
-		bin.insert(bin.end(), str.begin(), str.end()+1);
-		shdr.sh_size += str.size()+1;
+	Elf_Shdr& shdr() {
+		return ((Elf_Shdr *)&bin[offsetof(ElfData, shdr)])[shindex];
+	}
+	size_t add(std::string_view str) {
+		bin.insert(bin.end(), str.begin(), str.end());
+		bin.push_back(0);
+		shdr().sh_size += str.size()+1;
 		const size_t offset = this->offset;
-		namelist[str] = offset;
 		this->offset += str.size()+1;
 		return offset;
 	}
-	size_t lookup(const std::string& str) const {
-		return namelist.at(str);
-	}
 	void append_null() {
 		bin.push_back(0);
-		shdr.sh_size += 1;
+		shdr().sh_size += 1;
 		this->offset += 1;
 	}
 };
 
 struct ElfSymSection {
-	Elf_Shdr& shdr;
 	std::vector<uint8_t>& bin;
+	const int shindex;
 
-	ElfSymSection(Elf_Shdr& sh, int strindex, std::vector<uint8_t>& b)
-		: shdr{sh}, bin{b}
+	ElfSymSection(int idx, int strindex, std::vector<uint8_t>& b)
+		: bin{b}, shindex{idx}
 	{
+		auto& shdr = this->shdr();
 		shdr.sh_type = SHT_SYMTAB;
 		shdr.sh_flags = 0;
 		shdr.sh_entsize = sizeof(Elf_Sym);
@@ -62,9 +73,12 @@ struct ElfSymSection {
 		this->add_sym(nosym);
 	}
 
-	void add(const std::string& name, Elf_Addr addr, int info, size_t size, ElfStringSection& str) {
+	Elf_Shdr& shdr() {
+		return ((Elf_Shdr *)&bin[offsetof(ElfData, shdr)])[shindex];
+	}
+	void add(size_t name, Elf_Addr addr, int info, size_t size) {
 		Elf_Sym sym {};
-		sym.st_name = str.lookup(name);
+		sym.st_name = name;
 		sym.st_shndx = SHN_UNDEF;
 		sym.st_info  = info;
 		sym.st_other = STV_DEFAULT;
@@ -75,29 +89,23 @@ struct ElfSymSection {
 	void add_sym(const Elf_Sym& sym) {
 		const uint8_t* s = (const uint8_t *)&sym;
 		bin.insert(bin.end(), s, s + sizeof(sym));
-		shdr.sh_size += sizeof(sym);
-		shdr.sh_info ++;
+		shdr().sh_size += sizeof(sym);
+		shdr().sh_info ++;
 	}
 
-	size_t count() const noexcept {
-		return shdr.sh_info;
+	size_t count() {
+		return shdr().sh_info;
 	}
 };
+} // namespace
 
-struct ElfData {
-	static inline constexpr size_t S = 3;
-	Elf_Ehdr hdr;
-	Elf_Shdr shdr[1 + S];
-	Elf_Phdr phdr[0];
-};
 
 void Elf_Writer(const Options& options,
 	Assembler& assembler, const std::string& outfile)
 {
 	auto& sections = assembler.sections();
 	size_t section_data_size = 0;
-	for (const auto& it : sections) {
-		auto& section = it.second;
+	for (const auto& section : sections) {
 		if constexpr (VERBOSE_SECTIONS) {
 			printf("Section %s has: CODE=%d DATA=%d RESV=%d\n",
 				section.name().c_str(), section.code, section.data, section.resv);
@@ -134,40 +142,45 @@ void Elf_Writer(const Options& options,
 	elf.e_shnum = 1 + ElfData::S;
 	elf.e_shstrndx = 1;
 
-	ElfStringSection shnames { elfdata->shdr[1], 1, elfbin };
+	ElfStringSection shnames { 1, elfbin };
 	/* We need to all all sections now. */
-	shnames.shdr.sh_name = shnames.add(".shstrtab");
-	shnames.add(".symtab");
-	shnames.add(".strtab");
+	shnames.shdr().sh_name = shnames.add(".shstrtab");
+	const size_t symtab_name = shnames.add(".symtab");
+	const size_t strtab_name = shnames.add(".strtab");
 
-	/* Add all strings now. */
-	ElfStringSection strings { elfdata->shdr[3], 3, elfbin };
-	strings.shdr.sh_name = shnames.lookup(".strtab");
-	for (const auto& sit : assembler.symbols()) {
-		strings.add(sit.first);
+	/* Add all strings now, remembering where each symbol's name is.
+	   Local labels are left out, as they are only known in their scope. */
+	const auto& symbols = assembler.symbols();
+	ElfStringSection strings { 3, elfbin };
+	strings.shdr().sh_name = strtab_name;
+	std::vector<size_t> names(symbols.size());
+	size_t defined = 0;
+	for (symbol_id id = 0; id < symbols.size(); id++) {
+		if (!symbols.is_defined(id) || symbols.is_local(id)) continue;
+		names[id] = strings.add(symbols.name(id));
+		defined++;
 	}
 
 	/* Add all the visible symbols */
-	ElfSymSection syms { elfdata->shdr[2], strings.shindex, elfbin };
-	syms.shdr.sh_name = shnames.lookup(".symtab");
-	for (const auto& sit : assembler.symbols()) {
-		auto& sym = sit.second;
+	ElfSymSection syms { 2, strings.shindex, elfbin };
+	syms.shdr().sh_name = symtab_name;
+	for (symbol_id id = 0; id < symbols.size(); id++) {
+		if (!symbols.is_defined(id) || symbols.is_local(id)) continue;
+		const auto& sym = symbols.location(id);
 		uint32_t info = sym.type | SHN_ABS;
-		if (assembler.globals().count(sit.first) > 0)
+		if (symbols.is_global(id))
 			info |= STB_GLOBAL;
 		else {
 			info |= STB_LOCAL;
 		}
-		syms.add(sit.first, sym.address(), sym.type, sym.size, strings);
+		syms.add(names[id], sym.address(), sym.type, sym.size);
 	}
-	syms.shdr.sh_info = assembler.symbols().size()+1;
-	file_writer(outfile, elfbin);
+	syms.shdr().sh_info = defined+1;
 
 	size_t sect = 0;
-	for (const auto& it : sections)
+	for (const auto& section : sections)
 	{
-		auto& program = elfdata->phdr[sect++];
-		auto& section = it.second;
+		auto& program = ((ElfData *)elfbin.data())->phdr[sect++];
 		const bool loadable = section.code || section.data;
 		program.p_type = loadable ? PT_LOAD : 0x0;
 		program.p_flags = 0;
@@ -196,6 +209,7 @@ void Elf_Writer(const Options& options,
 		program.p_filesz = (loadable) ? section.size() : 0u;
 		program.p_memsz = section.size();
 		program.p_align = 0x0;
+		/* NOTE: program is invalidated here. */
 		elfbin.insert(elfbin.end(), section.output.begin(), section.output.end());
 	}
 	file_writer(outfile, elfbin);
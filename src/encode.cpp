@@ -0,0 +1,296 @@
+#include "encoder.hpp"
+#include "opcodes.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+
+Encoder::Encoder(const Assembler& a, const TokenStream& tv, size_t begin,
+	SymbolLocation loc, std::vector<Relocation>& relocations,
+	std::vector<uint8_t>& programs, const symbol_id* locals)
+	: ExprParser(tv, begin, operands_end(tv, begin, tv[begin - 1].line())),
+	  m_assembler(a), m_begin(begin), m_section(loc.section), m_offset(loc.offset),
+	  m_relocations(relocations), m_programs(programs), m_locals(locals)
+{
+}
+
+size_t Encoder::operands_end(const TokenStream& tv, size_t i, uint32_t line)
+{
+	for (; i < tv.size(); i++) {
+		const auto tk = tv[i];
+		if (tk.line() != line) break;
+		switch (tk.type()) {
+		case TK_REGISTER:
+		case TK_CONSTANT:
+		case TK_OPERATOR:
+		case TK_SYMBOL:
+		case TK_STRING:
+			continue;
+		default:
+			return i;
+		}
+	}
+	return i;
+}
+
+size_t Encoder::count_locals(const TokenStream& tv, size_t begin, size_t end)
+{
+	size_t n = 0;
+	for (size_t i = begin; i < end; i++)
+		n += (tv[i].type() == TK_SYMBOL && tv[i].symbol() == SymbolTable::NONE);
+	return n;
+}
+
+__uint128_t Encoder::name(const Token& tk, ExprCode& code)
+{
+	if (tk.type() != TK_SYMBOL)
+		argument_mismatch(tk, TK_CONSTANT, " Expected an expression.");
+	code.symbol(symbol_of(tk));
+	return 0; /* Known once evaluated */
+}
+
+symbol_id Encoder::symbol_of(const Token& tk) const
+{
+	const symbol_id id = tk.symbol();
+	if (id != SymbolTable::NONE || m_locals == nullptr) return id;
+	return m_locals[count_locals(*m_tokens, m_begin, tk.index)];
+}
+
+void Encoder::record(RelocationKind kind, symbol_id id, uint32_t line,
+	int32_t addend, bool expression)
+{
+	m_relocations.push_back(Relocation{m_section, m_offset, addend,
+		id, line, kind, expression});
+}
+
+void Encoder::relocate(RelocationKind kind, const Token& tk, int32_t addend)
+{
+	this->record(kind, symbol_of(tk), tk.line(), addend, false);
+}
+
+Constant Assembler::resolve_constants()
+{
+	Encoder enc(*this, *tokens, index, current_location(), m_relocations, m_programs);
+	const auto value = enc.resolve_constants();
+	this->index = enc.position();
+	return value;
+}
+
+/* The layout pass. Instructions from a token stream that lasts as long
+   as the assembler take up their size and are left for encode_pending(),
+   in runs of instructions that follow each other. Those whose size
+   depends on their operands, and those from macro bodies and streamed
+   batches, are encoded right away. When only the layout is wanted,
+   the rest are never encoded, except branches and jumps that may
+   have to grow. Those are left in runs all the same, and are only
+   recorded once finish() finds one that doesn't reach. */
+void Assembler::encode(const Token& opcode)
+{
+	static constexpr uint32_t RUN_LENGTH = 1024;
+	align_with_labels(4);
+	const Opcode& op = *opcode.opcode();
+	const size_t end = Encoder::operands_end(*tokens, index, opcode.line());
+	if (options.layout_only && op.size != 0 && !op.relaxes) {
+		/* Only the size matters */
+		current_section().extend(OT_CODE, op.size);
+		this->index = end;
+		return;
+	}
+	const size_t locals = bind_locals(index, end);
+	if (!m_lasting) {
+		this->index = encode_now(op, m_local_ids.data() + locals);
+		m_local_ids.resize(locals);
+		return;
+	}
+
+	auto& section = current_section();
+	auto continues = [&] (const PendingRun& run) {
+		if (run.tokens != tokens || run.section != &section || run.end > opcode.index
+			|| run.offset + run.size != section.size() || run.count >= RUN_LENGTH)
+			return false;
+		/* Only labels in between */
+		for (size_t i = run.end; i < opcode.index; i++)
+			if ((*tokens)[i].type() != TK_LABEL) return false;
+		return true;
+	};
+	if (m_runs.empty() || !continues(m_runs.back())) {
+		m_runs.push_back(PendingRun{tokens, &section, section.size(),
+			opcode.index, opcode.index, (uint32_t)m_lengths.size(),
+			(uint32_t)locals, 0, 0});
+	}
+	auto& run = m_runs.back();
+
+	const size_t before = section.size();
+	if (op.size == 0) {
+		this->index = encode_now(op, m_local_ids.data() + locals);
+		m_lengths.push_back(section.size() - before);
+	} else {
+		section.extend(OT_CODE, op.size);
+		this->index = end;
+	}
+	run.end = end;
+	run.size += section.size() - before;
+	run.count++;
+}
+
+/* Encodes the instruction whose operands are next, returning
+   the position after the operands that were used. */
+size_t Assembler::encode_now(const Opcode& op, const symbol_id* locals)
+{
+	Encoder enc(*this, *tokens, index, current_location(),
+		m_relocations, m_programs, locals);
+	const auto il = op.handler(enc);
+	/* Grow the section once for the whole list. */
+	size_t len = 0;
+	for (const auto& instr : il)
+		len += instr.length();
+	auto* dst = current_section().extend(OT_CODE, len);
+	for (const auto& instr : il) {
+		std::memcpy(dst, instr.raw, instr.length());
+		dst += instr.length();
+	}
+	return enc.position();
+}
+
+void Assembler::encode_run(const PendingRun& run, std::vector<Relocation>& relocations,
+	std::vector<uint8_t>& programs, uint32_t& line) const
+{
+	const auto& tv = *run.tokens;
+	uint64_t offset = run.offset;
+	const uint8_t* length = m_lengths.data() + run.lengths;
+	const symbol_id* locals = m_local_ids.data() + run.locals;
+	for (size_t i = run.begin; i < run.end; ) {
+		const auto tk = tv[i];
+		if (tk.type() == TK_LABEL) {
+			i++;
+			continue;
+		}
+		line = tk.line();
+		const Opcode& op = *tk.opcode();
+		if (op.size == 0) {
+			/* Encoded during layout */
+			offset += *length++;
+			const size_t end = Encoder::operands_end(tv, i + 1, tk.line());
+			locals += Encoder::count_locals(tv, i + 1, end);
+			i = end;
+			continue;
+		}
+		Encoder enc(*this, tv, i + 1, {run.section, offset},
+			relocations, programs, locals);
+		const auto il = op.handler(enc);
+		if (!enc.done())
+			token_exception(tv[enc.position()], "Unexpected token");
+		size_t len = 0;
+		for (const auto& instr : il)
+			len += instr.length();
+		if (len != op.size) {
+			[[unlikely]];
+			token_exception(tk, "Instruction size differs from its layout");
+		}
+		uint8_t* dst = run.section->output.data() + offset;
+		for (const auto& instr : il) {
+			std::memcpy(dst, instr.raw, instr.length());
+			dst += instr.length();
+		}
+		offset += op.size;
+		locals += Encoder::count_locals(tv, i + 1, enc.position());
+		i = enc.position();
+	}
+}
+
+/* Binds the local labels among the operands, in order, returning
+   where they start in m_local_ids. */
+size_t Assembler::bind_locals(size_t begin, size_t end)
+{
+	const size_t first = m_local_ids.size();
+	for (size_t i = begin; i < end; i++) {
+		const auto tk = (*tokens)[i];
+		if (tk.type() == TK_SYMBOL && tk.symbol() == SymbolTable::NONE)
+			m_local_ids.push_back(bind_reference(tk));
+	}
+	return first;
+}
+
+/* The encoding pass, over runs in parallel. Once every section has
+   its address the references of an instruction are resolved right
+   after it is encoded, and otherwise they are recorded for finish().
+   Problems are reported ordered by line, like in finish_relocations.
+   The runs are all from this assembler's own file.
+   Returns false, with the runs left as they were, when something that
+   relaxes turns out to be out of reach, as the layout has to change.
+   When only the layout is wanted, nothing else is resolved. */
+bool Assembler::encode_pending(bool resolve_now)
+{
+	static constexpr size_t MIN_RUNS = 16;
+	std::vector<Problem> problems;
+	std::mutex problems_mtx;
+	std::atomic<bool> far = false;
+	/* Keeps the relocation dump complete */
+	if (options.verbose_relocations) resolve_now = false;
+
+	std::vector<std::vector<Relocation>> recorded(m_runs.size());
+	std::vector<std::vector<uint8_t>> programs(m_runs.size());
+	parallel_for(m_runs.size(), MIN_RUNS,
+		[&] (size_t begin, size_t end) {
+			/* What is resolved right away is not kept */
+			std::vector<Relocation> resolved;
+			std::vector<uint8_t> resolved_programs;
+			for (size_t r = begin; r < end; r++) {
+				/* The runs are encoded again after relaxing */
+				if (far) break;
+				if (options.layout_only && resolve_now && this->run_in_reach(m_runs[r]))
+					continue;
+				auto& relocations = resolve_now ? resolved : recorded[r];
+				auto& program = resolve_now ? resolved_programs : programs[r];
+				relocations.clear();
+				program.clear();
+				uint32_t line = 0;
+				try {
+					this->encode_run(m_runs[r], relocations, program, line);
+				} catch (const std::exception& e) {
+					/* Token problems were printed when found */
+					std::lock_guard<std::mutex> lock(problems_mtx);
+					problems.push_back({m_file, line, r, e.what(), true});
+					continue;
+				}
+				if (!resolve_now) continue;
+				for (const auto& rel : relocations) {
+					if (rel.relaxes() && !this->reaches(rel, program.data())) {
+						far = true;
+						break;
+					}
+					if (options.layout_only) continue;
+					try {
+						this->resolve(rel, program.data());
+					} catch (const std::exception& e) {
+						std::lock_guard<std::mutex> lock(problems_mtx);
+						problems.push_back({m_file, rel.line, r, e.what(), false});
+					}
+				}
+			}
+		});
+
+	/* Other problems may be gone once the layout changes, except
+	   for those found while encoding, which stop there. */
+	if (far && std::none_of(problems.begin(), problems.end(),
+			[] (const Problem& p) { return p.reported; }))
+		return false;
+	if (!problems.empty())
+		report(problems);
+	for (size_t r = 0; r < recorded.size(); r++) {
+		const auto& relocations = recorded[r];
+		const size_t first = m_relocations.size();
+		m_relocations.insert(m_relocations.end(), relocations.begin(), relocations.end());
+		if (programs[r].empty()) continue;
+		/* Expressions move to the end of the program pool */
+		for (size_t i = first; i < m_relocations.size(); i++)
+			if (m_relocations[i].expression)
+				m_relocations[i].symbol += m_programs.size();
+		m_programs.insert(m_programs.end(), programs[r].begin(), programs[r].end());
+	}
+	m_runs.clear();
+	m_lengths.clear();
+	m_local_ids.clear();
+	return true;
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include "assembler.hpp"
+#include "expression.hpp"
+
+/* Reads the operands of one instruction, which are the tokens after
+   the opcode on the same line, and records the relocations it needs.
+   Instructions are encoded either as they are assembled, or once the
+   layout is done, in parallel with an encoder each. See encode.cpp */
+struct Encoder : ExprParser {
+	using ExprParser::next;
+	template <TokenType T>
+	Token next(const char* info = "") {
+		const auto tk = next();
+		if (tk.type() != T) {
+			argument_mismatch(tk, T, info);
+		}
+		return tk;
+	}
+	/* Operands left on the line */
+	size_t remaining() const noexcept { return m_end - m_index; }
+	/* Constants, symbols and operators can start an expression */
+	bool next_is_expression() const {
+		return next_is(TK_CONSTANT) || next_is(TK_SYMBOL) || next_is(TK_OPERATOR);
+	}
+	/* An expression that may only use constants. */
+	Constant resolve_constants();
+	/* An expression that may use symbols. When it does, the value
+	   is left deferred, and the relocation completes it later. */
+	Constant expression(RelocationKind, int32_t addend = 0);
+
+	/* Fix up the instruction once the symbol has an address. */
+	void relocate(RelocationKind, const Token& symbol, int32_t addend = 0);
+	/* Relocations now apply at this offset, for lists of data. */
+	void move_to(uint64_t offset) noexcept { m_offset = offset; }
+
+	[[noreturn]] void token_exception(const Token& tk, const std::string& info) const {
+		m_assembler.token_exception(tk, info);
+	}
+	[[noreturn]] void argument_mismatch(const Token& tk, TokenType tt, const char* info) const {
+		m_assembler.argument_mismatch(tk, tt, info);
+	}
+
+	/* The end of the operands starting at token i, on the given line. */
+	static size_t operands_end(const TokenStream&, size_t i, uint32_t line);
+	/* Local labels among the tokens, which are bound during layout */
+	static size_t count_locals(const TokenStream&, size_t begin, size_t end);
+
+	/* The operands start at token begin, right after the opcode.
+	   Locals are the symbols bound to the local labels among them. */
+	Encoder(const Assembler&, const TokenStream&, size_t begin,
+		SymbolLocation, std::vector<Relocation>& relocations,
+		std::vector<uint8_t>& programs, const symbol_id* locals = nullptr);
+private:
+	/* Names are symbols, completed once evaluated */
+	__uint128_t name(const Token&, ExprCode&) override;
+	[[noreturn]] void error(const Token& tk, const std::string& info) const override {
+		token_exception(tk, info);
+	}
+	symbol_id symbol_of(const Token&) const;
+	void record(RelocationKind, symbol_id, uint32_t line, int32_t addend, bool expression);
+
+	const Assembler& m_assembler;
+	const size_t m_begin;
+	const Section* m_section;
+	uint64_t m_offset;
+	std::vector<Relocation>& m_relocations;
+	/* Bytecode of the expressions among the relocations */
+	std::vector<uint8_t>& m_programs;
+	const symbol_id* m_locals;
+};
@@ -0,0 +1,248 @@
+#include "expression.hpp"
+#include "encoder.hpp"
+#include <cstring>
+
+void ExprCode::emit(ExprOp op, const void* data, size_t len)
+{
+	reserve(1 + len);
+	code[size] = op;
+	std::memcpy(&code[size + 1], data, len);
+	size += 1 + len;
+}
+
+bool expr_apply(ExprOp op, __uint128_t& lhs, __uint128_t rhs)
+{
+	const auto sl = (__int128_t)lhs, sr = (__int128_t)rhs;
+	switch (op) {
+	case X_NEG: lhs = -lhs; break;
+	case X_NOT: lhs = ~lhs; break;
+	case X_LNOT: lhs = !lhs; break;
+	case X_MUL: lhs = lhs * rhs; break;
+	case X_DIV:
+		if (rhs == 0) return false;
+		/* The most negative value divided by -1 overflows */
+		lhs = (sr == -1) ? -lhs : (__uint128_t)(sl / sr);
+		break;
+	case X_MOD:
+		if (rhs == 0) return false;
+		lhs = (sr == -1) ? 0 : (__uint128_t)(sl % sr);
+		break;
+	case X_ADD: lhs = lhs + rhs; break;
+	case X_SUB: lhs = lhs - rhs; break;
+	/* Shifting all the bits out leaves zero */
+	case X_SHL: lhs = (rhs < 128) ? lhs << rhs : 0; break;
+	case X_SHR: lhs = (rhs < 128) ? lhs >> rhs : 0; break;
+	case X_LT: lhs = sl < sr; break;
+	case X_LE: lhs = sl <= sr; break;
+	case X_GT: lhs = sl > sr; break;
+	case X_GE: lhs = sl >= sr; break;
+	case X_EQ: lhs = lhs == rhs; break;
+	case X_NE: lhs = lhs != rhs; break;
+	case X_AND: lhs = lhs & rhs; break;
+	case X_XOR: lhs = lhs ^ rhs; break;
+	case X_OR:  lhs = lhs | rhs; break;
+	case X_LAND: lhs = lhs && rhs; break;
+	case X_LOR:  lhs = lhs || rhs; break;
+	default:
+		throw std::runtime_error("Invalid expression bytecode");
+	}
+	return true;
+}
+
+address_t expr_evaluate(const uint8_t* code, const SymbolTable& symbols)
+{
+	return expr_evaluate(code, [&symbols] (symbol_id id) -> address_t {
+		if (!symbols.is_defined(id))
+			throw std::runtime_error("Unknown symbol scheduled: "
+				+ std::string(symbols.name(id)));
+		return symbols.location(id).address();
+	});
+}
+
+address_t expr_evaluate(const uint8_t* code,
+	const std::function<address_t(symbol_id)>& address)
+{
+	/* The bytecode has at most this many operands */
+	__uint128_t stack[ExprCode::CAPACITY / (1 + sizeof(symbol_id))];
+	size_t sp = 0;
+	for (;;) {
+		const ExprOp op = (ExprOp)*code++;
+		switch (op) {
+		case X_END:
+			return stack[0];
+		case X_CONST64: {
+			int64_t value;
+			std::memcpy(&value, code, sizeof(value));
+			code += sizeof(value);
+			stack[sp++] = (__int128)value;
+			} break;
+		case X_CONST128:
+			std::memcpy(&stack[sp++], code, sizeof(__uint128_t));
+			code += sizeof(__uint128_t);
+			break;
+		case X_SYMBOL: {
+			symbol_id id;
+			std::memcpy(&id, code, sizeof(id));
+			code += sizeof(id);
+			stack[sp++] = address(id);
+			} break;
+		case X_NEG:
+		case X_NOT:
+		case X_LNOT:
+			expr_apply(op, stack[sp - 1], 0);
+			break;
+		default:
+			sp--;
+			if (!expr_apply(op, stack[sp - 1], stack[sp]))
+				throw std::runtime_error("Division by zero in expression");
+		}
+	}
+}
+
+void expr_remap(uint8_t* code, const std::vector<symbol_id>& ids)
+{
+	for (;;) {
+		switch ((ExprOp)*code++) {
+		case X_END:
+			return;
+		case X_CONST64:
+			code += sizeof(int64_t);
+			break;
+		case X_CONST128:
+			code += sizeof(__uint128_t);
+			break;
+		case X_SYMBOL: {
+			symbol_id id;
+			std::memcpy(&id, code, sizeof(id));
+			id = ids.at(id);
+			std::memcpy(code, &id, sizeof(id));
+			code += sizeof(id);
+			} break;
+		default:
+			break;
+		}
+	}
+}
+
+/* Binding strength of binary operators, as in C. */
+static int precedence(std::string_view op, ExprOp& xop)
+{
+	if (op.size() == 1) {
+		switch (op[0]) {
+		case '*': xop = X_MUL; return 9;
+		case '/': xop = X_DIV; return 9;
+		case '%': xop = X_MOD; return 9;
+		case '+': xop = X_ADD; return 8;
+		case '-': xop = X_SUB; return 8;
+		case '<': xop = X_LT;  return 6;
+		case '>': xop = X_GT;  return 6;
+		case '&': xop = X_AND; return 4;
+		case '^': xop = X_XOR; return 3;
+		case '|': xop = X_OR;  return 2;
+		}
+	} else if (op.size() == 2) {
+		switch (op[0] << 8 | op[1]) {
+		case '<' << 8 | '<': xop = X_SHL; return 7;
+		case '>' << 8 | '>': xop = X_SHR; return 7;
+		case '<' << 8 | '=': xop = X_LE;  return 6;
+		case '>' << 8 | '=': xop = X_GE;  return 6;
+		case '=' << 8 | '=': xop = X_EQ;  return 5;
+		case '!' << 8 | '=': xop = X_NE;  return 5;
+		case '&' << 8 | '&': xop = X_LAND; return 1;
+		case '|' << 8 | '|': xop = X_LOR;  return 0;
+		}
+	}
+	return -1;
+}
+
+void ExprParser::end_of_line() const
+{
+	error((*m_tokens)[m_index - 1], "Expected more operands on this line");
+}
+
+__uint128_t ExprParser::parse_operand(ExprCode& code)
+{
+	const auto tk = next();
+	switch (tk.type()) {
+	case TK_CONSTANT:
+		code.constant(tk.u128());
+		return tk.u128();
+	case TK_OPERATOR: {
+		const auto op = tk.value();
+		if (op == "(") {
+			const auto value = parse_binary(0, code);
+			if (!next_is(TK_OPERATOR) || (*m_tokens)[m_index].value() != ")")
+				error(tk, "Missing ) in expression");
+			m_index++;
+			return value;
+		}
+		ExprOp xop = X_END;
+		if (op == "-") xop = X_NEG;
+		else if (op == "~") xop = X_NOT;
+		else if (op == "!") xop = X_LNOT;
+		else if (op == "+") return parse_operand(code);
+		else error(tk, "Unexpected operator");
+		__uint128_t value = parse_operand(code);
+		code.op(xop);
+		expr_apply(xop, value, 0);
+		return value;
+		}
+	default:
+		return name(tk, code);
+	}
+}
+
+/* Precedence climbing */
+__uint128_t ExprParser::parse_binary(int min_precedence, ExprCode& code)
+{
+	__uint128_t lhs = parse_operand(code);
+	while (next_is(TK_OPERATOR) && !(*m_tokens)[m_index - 1].comma()) {
+		const auto tk = (*m_tokens)[m_index];
+		ExprOp op = X_END;
+		const int prec = precedence(tk.value(), op);
+		if (prec < min_precedence) break;
+		m_index++;
+		const __uint128_t rhs = parse_binary(prec + 1, code);
+		code.op(op);
+		/* With symbols, the folded value is not used */
+		if (!expr_apply(op, lhs, rhs) && code.symbols == 0)
+			error(tk, "Division by zero");
+	}
+	return lhs;
+}
+
+Constant Encoder::resolve_constants()
+{
+	if (done()) end_of_line();
+	ExprCode code;
+	Constant result;
+	result.token = (*m_tokens)[m_index];
+	result.u128 = parse(code);
+	if (code.symbols != 0)
+		token_exception(result.token, "Expected a constant expression");
+	return result;
+}
+
+Constant Encoder::expression(RelocationKind kind, int32_t addend)
+{
+	if (done()) end_of_line();
+	ExprCode code;
+	Constant result;
+	result.token = (*m_tokens)[m_index];
+	result.u128 = parse(code);
+	if (code.symbols == 0)
+		return result;
+
+	result.u128 = 0;
+	result.deferred = true;
+	if (code.is_symbol()) {
+		this->record(kind, code.first_symbol, result.token.line(), addend, false);
+		result.symbol = true;
+		return result;
+	}
+	code.op(X_END);
+	const size_t start = m_programs.size();
+	m_programs.insert(m_programs.end(), code.code, code.code + code.size);
+	this->record(kind, start, result.token.line(), addend, true);
+	return result;
+}
@@ -0,0 +1,129 @@
+#pragma once
+#include "symbols.hpp"
+#include "types.hpp"
+#include <functional>
+#include <stdexcept>
+
+/* Expressions that refer to symbols are kept as postfix bytecode, and
+   evaluated once every symbol has an address. Each operation is one
+   byte, followed by the value for constants and the ID for symbols. */
+enum ExprOp : uint8_t {
+	X_END,
+	X_CONST64,  /* int64_t, sign-extended */
+	X_CONST128, /* __uint128_t */
+	X_SYMBOL,   /* symbol_id */
+	X_NEG,
+	X_NOT,
+	X_LNOT,
+	X_MUL,
+	X_DIV,
+	X_MOD,
+	X_ADD,
+	X_SUB,
+	X_SHL,
+	X_SHR,
+	X_LT,
+	X_LE,
+	X_GT,
+	X_GE,
+	X_EQ,
+	X_NE,
+	X_AND,
+	X_XOR,
+	X_OR,
+	X_LAND,
+	X_LOR,
+};
+
+/* The bytecode of one expression as it is parsed, in a fixed buffer,
+   so that parsing constant expressions never allocates. */
+struct ExprCode {
+	static constexpr size_t CAPACITY = 192;
+
+	void op(ExprOp op) {
+		reserve(1);
+		code[size++] = op;
+	}
+	void constant(__uint128_t value) {
+		if ((__int128)value == (int64_t)value) {
+			const int64_t v = value;
+			emit(X_CONST64, &v, sizeof(v));
+		} else {
+			emit(X_CONST128, &value, sizeof(value));
+		}
+	}
+	void symbol(symbol_id id) {
+		if (symbols++ == 0) first_symbol = id;
+		emit(X_SYMBOL, &id, sizeof(id));
+	}
+	/* Just one symbol, and nothing else */
+	bool is_symbol() const noexcept {
+		return symbols == 1 && size == 1 + sizeof(symbol_id);
+	}
+
+	uint8_t code[CAPACITY];
+	size_t size = 0;
+	unsigned symbols = 0;
+	symbol_id first_symbol = 0;
+private:
+	void reserve(size_t len) {
+		if (size + len > CAPACITY) {
+			[[unlikely]];
+			throw std::runtime_error("Expression is too long");
+		}
+	}
+	void emit(ExprOp op, const void* data, size_t len);
+};
+
+/* Applies a binary or unary (with rhs unused) operation. Division,
+   remainder and comparisons are signed, and shifts are logical, with
+   shifts by 128 or more giving zero. Returns false on division by
+   zero. */
+bool expr_apply(ExprOp, __uint128_t& lhs, __uint128_t rhs);
+/* Evaluates bytecode ending with X_END. Throws on unknown symbols. */
+address_t expr_evaluate(const uint8_t* code, const SymbolTable&);
+/* The same, with the address of each symbol from address(id) */
+address_t expr_evaluate(const uint8_t* code,
+	const std::function<address_t(symbol_id)>& address);
+/* Changes the symbol IDs in the bytecode to ids[old ID]. */
+void expr_remap(uint8_t* code, const std::vector<symbol_id>& ids);
+
+/* Parses expressions with the operators of C, in C precedence, from
+   tokens into bytecode, folding constants as it goes. Instructions
+   and .if both use it, so that expressions mean the same everywhere.
+   Subclasses decide what names are, and how problems are reported. */
+struct ExprParser {
+	Token next() {
+		if (m_index >= m_end) {
+			[[unlikely]];
+			end_of_line();
+		}
+		return (*m_tokens)[m_index++];
+	}
+	bool next_is(TokenType tt) const {
+		return m_index < m_end && (*m_tokens)[m_index].type() == tt;
+	}
+	bool done() const noexcept { return m_index >= m_end; }
+	size_t position() const noexcept { return m_index; }
+	/* One expression, starting at the next token. Parsing ends at a
+	   comma, or at anything that isn't a binary operator, such as the
+	   next item of a data list. */
+	__uint128_t parse(ExprCode& code) { return parse_binary(0, code); }
+
+	ExprParser(const TokenStream& tokens, size_t begin, size_t end)
+		: m_tokens(&tokens), m_index(begin), m_end(end) {}
+protected:
+	~ExprParser() = default;
+	/* Adds the operand a name refers to, and returns its value, or
+	   anything when it is only known once evaluated. */
+	virtual __uint128_t name(const Token&, ExprCode&) = 0;
+	[[noreturn]] virtual void error(const Token&, const std::string& info) const = 0;
+	void end_of_line() const; /* Reports with error() */
+
+	const TokenStream* m_tokens;
+	size_t m_index;
+	size_t m_end;
+private:
+	__uint128_t parse_operand(ExprCode&);
+	__uint128_t parse_binary(int min_precedence, ExprCode&);
+};
@@ -0,0 +1,97 @@
+#pragma once
+#include "types.hpp"
+
+template <typename T>
+struct NamedEntry {
+	std::string_view name;
+	T value;
+};
+
+/* A mnemonic, register name or pseudo-op. */
+struct Keyword {
+	std::string_view name;
+	TokenType type = TK_SYMBOL;
+	const Opcode*   opcode = nullptr;
+	const PseudoOp* pseudoop = nullptr;
+	uint8_t reg = 0;
+	uint8_t index = 0;
+};
+
+struct Keywords {
+	static const Keyword* lookup(std::string_view) noexcept;
+	static const Keyword& get(uint32_t index) noexcept;
+};
+
+/* Perfect hash over every keyword, generated at compile time by
+   searching for a seed that gives each keyword a slot of its own.
+   A lookup is one hash, one probe and one compare. */
+template <size_t N>
+struct KeywordTable {
+	static constexpr size_t SLOTS = 4096;
+	static constexpr uint8_t EMPTY = 0xFF;
+	static_assert(N < EMPTY, "Too many keywords for 8-bit slots");
+
+	static constexpr uint32_t hash(std::string_view name, uint32_t seed) noexcept {
+		uint32_t h = 2166136261u ^ seed;
+		for (const char c : name) {
+			h ^= (uint8_t)c;
+			h *= 16777619u;
+		}
+		return (h ^ (h >> 15)) & (SLOTS - 1);
+	}
+
+	const Keyword* lookup(std::string_view name) const noexcept {
+		const uint8_t idx = slots[hash(name, seed)];
+		if (idx != EMPTY && entries[idx].name == name)
+			return &entries[idx];
+		return nullptr;
+	}
+
+	template <size_t A, size_t B, size_t C>
+	constexpr KeywordTable(const NamedEntry<const Opcode*> (&opcodes)[A],
+		const NamedEntry<uint8_t> (&registers)[B],
+		const NamedEntry<const PseudoOp*> (&pseudoops)[C])
+	{
+		size_t n = 0;
+		for (const auto& op : opcodes) {
+			entries[n].name = op.name;
+			entries[n].type = TK_OPCODE;
+			entries[n++].opcode = op.value;
+		}
+		for (const auto& reg : registers) {
+			entries[n].name = reg.name;
+			entries[n].type = TK_REGISTER;
+			entries[n++].reg = reg.value;
+		}
+		for (const auto& op : pseudoops) {
+			entries[n].name = op.name;
+			entries[n].type = TK_PSEUDOOP;
+			entries[n++].pseudoop = op.value;
+		}
+		for (size_t i = 0; i < N; i++)
+			entries[i].index = i;
+		while (!try_seed(seed)) seed++;
+	}
+
+	Keyword  entries[N] {};
+	uint8_t  slots[SLOTS] {};
+	uint32_t seed = 0;
+private:
+	constexpr bool try_seed(uint32_t s) {
+		for (auto& slot : slots) slot = EMPTY;
+		for (size_t i = 0; i < N; i++) {
+			auto& slot = slots[hash(entries[i].name, s)];
+			if (slot != EMPTY) return false;
+			slot = i;
+		}
+		return true;
+	}
+};
+
+template <size_t A, size_t B, size_t C>
+constexpr auto make_keyword_table(const NamedEntry<const Opcode*> (&opcodes)[A],
+	const NamedEntry<uint8_t> (&registers)[B],
+	const NamedEntry<const PseudoOp*> (&pseudoops)[C])
+{
+	return KeywordTable<A + B + C> (opcodes, registers, pseudoops);
+}
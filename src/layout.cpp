@@ -0,0 +1,58 @@
+#include "assembler.hpp"
+#include <elf.h>
+
+static std::string hex(address_t value)
+{
+	return "0x" + to_hex_string(value);
+}
+
+static const char* symbol_type(uint32_t type)
+{
+	switch (type) {
+	case STT_FUNC:   return "func";
+	case STT_OBJECT: return "object";
+	default:         return "notype";
+	}
+}
+
+/* Writes a map of the sections and symbols, one per line with fields
+   separated by tabs, as --layout-only does instead of the ELF:
+
+   section  name  address  size  flags
+   symbol   name  address  size  type  binding  section
+
+   Sizes are decimal and addresses are hexadecimal. Flags are RWX, in
+   the same way as the ELF program headers. Local labels are left out,
+   as they are from the ELF symbol table. */
+bool layout_writer(Assembler& assembler, const std::string& filename)
+{
+	FILE* f = fopen(filename.c_str(), "w");
+	if (f == NULL)
+		return false;
+
+	for (const auto& section : assembler.sections())
+	{
+		const bool readable = (!section.code || !section.execonly)
+			&& (section.data || section.resv);
+		fprintf(f, "section\t%s\t%s\t%zu\t%c%c%c\n",
+			section.name().c_str(), hex(section.base_address()).c_str(),
+			section.size(),
+			readable ? 'R' : '-',
+			(readable && !section.readonly) ? 'W' : '-',
+			section.code ? 'X' : '-');
+	}
+
+	const auto& symbols = assembler.symbols();
+	for (symbol_id id = 0; id < symbols.size(); id++)
+	{
+		if (!symbols.is_defined(id) || symbols.is_local(id)) continue;
+		const auto name = symbols.name(id);
+		const auto& loc = symbols.location(id);
+		fprintf(f, "symbol\t%.*s\t%s\t%llu\t%s\t%s\t%s\n",
+			(int)name.size(), name.data(), hex(loc.address()).c_str(),
+			(unsigned long long)loc.size, symbol_type(loc.type),
+			symbols.is_global(id) ? "global" : "local",
+			loc.section->name().c_str());
+	}
+	return fclose(f) == 0;
+}
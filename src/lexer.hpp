@@ -0,0 +1,88 @@
+#pragma once
+#include "assembler.hpp"
+
+inline char escape_character(char echar)
+{
+	switch (echar) {
+	case 'n': return '\n';
+	case 'r': return '\r';
+	case 't': return '\t';
+	case 'b': return '\b';
+	case '\\': return '\\';
+	case '\'': return '\'';
+	case '\"': return '\"';
+	case '0': return 0;
+	default:
+		fprintf(stderr, "Unknown escape character: %c\n", echar);
+		return echar;
+	}
+}
+
+/* Words are views into the source, unless they contain escaped
+   characters. Those are built in a scratch buffer instead, and
+   then stored in the arena. */
+struct Word {
+	std::string_view source;
+	size_t begin = 0;
+	size_t length = 0;
+	bool escaped = false;
+	std::string scratch;
+
+	bool empty() const noexcept { return length == 0 && !escaped; }
+	void append(size_t i) {
+		if (escaped) {
+			scratch.push_back(source[i]);
+		} else {
+			if (length == 0) begin = i;
+			length++;
+		}
+	}
+	void append_escaped(char c) {
+		if (!escaped) {
+			scratch.assign(source.substr(begin, length));
+			escaped = true;
+		}
+		scratch.push_back(c);
+	}
+	void flush(TokenStream& tokens, StringArena& arena, uint32_t line) {
+		if (escaped) {
+			Assembler::parse(tokens, {arena.store(scratch), line});
+			scratch.clear();
+			escaped = false;
+		} else if (length > 0) {
+			Assembler::parse(tokens, {source.substr(begin, length), line});
+		}
+		length = 0;
+	}
+};
+
+/* The reference character-at-a-time lexer. The vectorized lexers
+   skip ahead on their own, and hand over to this one whenever they
+   run into something unusual, like escaped characters. */
+struct ScalarLexer {
+	TokenStream& tokens;
+	StringArena& arena;
+	Word word;
+	uint32_t line = 1;
+	bool begin_quotes = false;
+	bool begin_comment = false;
+	bool begin_escape = false;
+
+	/* Lex from position i. When settle is true, return the position
+	   after the first character that leaves the lexer idle. */
+	size_t run(size_t i, bool settle);
+	void step(size_t i);
+	void finish() { word.flush(tokens, arena, line); }
+	bool idle() const noexcept {
+		return word.empty() && !begin_quotes && !begin_comment && !begin_escape;
+	}
+
+	ScalarLexer(TokenStream& tv, StringArena& a, std::string_view source, uint32_t ln)
+		: tokens{tv}, arena{a}, line{ln} { word.source = source; }
+};
+
+extern void split_scalar(TokenStream&, std::string_view, StringArena&, uint32_t line);
+#if defined(__x86_64__) || defined(__i386__)
+extern void split_sse2(TokenStream&, std::string_view, StringArena&, uint32_t line);
+extern void split_avx2(TokenStream&, std::string_view, StringArena&, uint32_t line);
+#endif
@@ -0,0 +1,119 @@
+#include "literal.hpp"
+
+/* A table avoids mispredicted branches between digits and letters. */
+static constexpr struct DigitTable {
+	uint8_t value[256] {};
+	constexpr DigitTable() {
+		for (unsigned c = 0; c < 256; c++) value[c] = 36;
+		for (unsigned c = '0'; c <= '9'; c++) value[c] = c - '0';
+		for (unsigned c = 'a'; c <= 'z'; c++) value[c] = c - 'a' + 10;
+		for (unsigned c = 'A'; c <= 'Z'; c++) value[c] = c - 'A' + 10;
+	}
+} digit_table;
+
+static inline unsigned digit_value(char c) noexcept
+{
+	return digit_table.value[(uint8_t)c];
+}
+
+/* Separators must have a digit on both sides. */
+static inline bool is_separator(const char* p, const char* last, unsigned base) noexcept
+{
+	return *p == '_' && p + 1 < last && digit_value(p[1]) < base;
+}
+
+/* Digits are gathered 64 bits at a time, and then shifted or multiplied
+   into the 128-bit value, which avoids 128-bit arithmetic per digit. */
+struct DigitChunk {
+	uint64_t value = 0;
+	unsigned count = 0;
+};
+template <unsigned Base, unsigned MaxDigits>
+static inline const char* parse_chunk(const char* p, const char* last, DigitChunk& chunk) noexcept
+{
+	for (; p < last && chunk.count < MaxDigits; p++) {
+		const unsigned d = digit_value(*p);
+		if (d >= Base) {
+			if (is_separator(p, last, Base)) continue;
+			break;
+		}
+		chunk.value = chunk.value * Base + d;
+		chunk.count++;
+	}
+	return p;
+}
+
+/* Power-of-two bases overflow when bits are shifted out of the top. */
+template <unsigned Bits>
+static const char* parse_pow2(const char* p, const char* last, __uint128_t& value, bool& overflow) noexcept
+{
+	constexpr unsigned MaxDigits = 64 / Bits;
+	while (true) {
+		DigitChunk chunk;
+		p = parse_chunk<1u << Bits, MaxDigits> (p, last, chunk);
+		if (chunk.count == 0) break;
+		const unsigned shift = chunk.count * Bits;
+		overflow |= (value >> (128 - shift)) != 0;
+		value = (value << shift) | chunk.value;
+		if (chunk.count < MaxDigits) break;
+	}
+	return p;
+}
+
+static const char* parse_decimal(const char* p, const char* last, __uint128_t& value, bool& overflow) noexcept
+{
+	static constexpr uint64_t POW10[] = {
+		1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull,
+		10000000ull, 100000000ull, 1000000000ull, 10000000000ull,
+		100000000000ull, 1000000000000ull, 10000000000000ull,
+		100000000000000ull, 1000000000000000ull, 10000000000000000ull,
+		100000000000000000ull, 1000000000000000000ull, 10000000000000000000ull,
+	};
+	constexpr __uint128_t MAX = ~(__uint128_t)0;
+	while (true) {
+		DigitChunk chunk;
+		p = parse_chunk<10, 19> (p, last, chunk);
+		if (chunk.count == 0) break;
+		const uint64_t scale = POW10[chunk.count];
+		/* Only literals longer than 19 digits get here with a value. */
+		if (value != 0)
+			overflow |= value > (MAX - chunk.value) / scale;
+		value = value * scale + chunk.value;
+		if (chunk.count < 19) break;
+	}
+	return p;
+}
+
+std::from_chars_result parse_literal(const char* first, const char* last, __uint128_t& value) noexcept
+{
+	const char* p = first;
+	const bool negative = (p < last && *p == '-');
+	if (p < last && (*p == '-' || *p == '+')) p++;
+
+	unsigned base = 10;
+	if (last - p > 2 && p[0] == '0') {
+		switch (p[1] | 0x20) {
+		case 'x': base = 16; break;
+		case 'b': base = 2; break;
+		case 'o': base = 8; break;
+		}
+		if (base != 10) p += 2;
+	}
+	/* There must be at least one digit, and no leading separator. */
+	if (p >= last || digit_value(*p) >= base)
+		return {first, std::errc::invalid_argument};
+
+	__uint128_t result = 0;
+	bool overflow = false;
+	switch (base) {
+	case 16: p = parse_pow2<4> (p, last, result, overflow); break;
+	case 8:  p = parse_pow2<3> (p, last, result, overflow); break;
+	case 2:  p = parse_pow2<1> (p, last, result, overflow); break;
+	default: p = parse_decimal(p, last, result, overflow); break;
+	}
+	if (overflow)
+		return {p, std::errc::result_out_of_range};
+
+	value = negative ? -result : result;
+	return {p, std::errc{}};
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include <charconv>
+#include <cstdint>
+
+/* Parses an integer literal of up to 128 bits, without allocating:
+     [+-] (0x hex | 0b binary | 0o octal | decimal)
+   Digits may be grouped with '_' separators, eg. 0xFFFF_0000.
+   Negative literals are returned in two's complement. Like
+   std::from_chars, ptr points past the last character consumed,
+   and ec is result_out_of_range if the value needs more than
+   128 bits, or invalid_argument if there are no digits. */
+extern std::from_chars_result parse_literal(const char* first, const char* last, __uint128_t& value) noexcept;
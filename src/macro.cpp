@@ -0,0 +1,164 @@
+#include "assembler.hpp"
+#include <algorithm>
+
+/* Records tokens into body until the directive ending the body,
+   keeping track of nested bodies of the same kind. */
+void Assembler::record_body(TokenStream& body,
+	std::string_view begin, std::string_view end, const Token& start)
+{
+	/* Streamed tokens are only valid until their batch is gone,
+	   so their text has to be stored. */
+	const bool store_text = (m_stream != nullptr);
+	size_t depth = 0;
+	while (true) {
+		if (done())
+			token_exception(start, "Missing " + std::string(end));
+		const auto tk = next();
+		if (tk.type() == TK_DIRECTIVE) {
+			if (tk.value() == begin) {
+				depth++;
+			} else if (tk.value() == end) {
+				if (depth == 0) return;
+				depth--;
+			}
+		}
+		const auto value = tk.value();
+		body.append(tk, store_text ? m_arena.store(value) : value);
+	}
+}
+
+void Assembler::define_macro(const Token& directive)
+{
+	const auto name = next<TK_SYMBOL>(" Expected macro name.");
+	auto res = m_macros.emplace(std::piecewise_construct,
+		std::forward_as_tuple(name.value()), std::forward_as_tuple());
+	if (!res.second)
+		token_exception(name, "Macro already defined");
+	auto& macro = res.first->second;
+
+	/* Parameters are on the same line as the name. */
+	std::vector<std::string_view> params;
+	while (next_on_line(name.line())) {
+		const auto param = next<TK_SYMBOL>(" Macro parameters must be names.");
+		params.push_back(param.value());
+	}
+	macro.params = params.size();
+
+	record_body(macro.body, ".macro", ".endm", directive);
+
+	for (size_t i = 0; i < macro.body.size(); i++) {
+		const auto tk = macro.body[i];
+		if (tk.type() != TK_SYMBOL) continue;
+		for (size_t p = 0; p < params.size(); p++) {
+			if (tk.value() == params[p]) {
+				const uint32_t slot = macro.body.add_constant(0);
+				macro.uses.push_back({(uint32_t)i, (uint32_t)p, slot});
+				break;
+			}
+		}
+	}
+}
+
+Macro* Assembler::find_macro(std::string_view name)
+{
+	auto it = m_macros.find(name);
+	return (it != m_macros.end()) ? &it->second : nullptr;
+}
+
+/* Arguments are the tokens on the same line as the name, separated
+   by commas. Without commas, each token is an argument. */
+static void read_arguments(Macro& macro, const TokenStream& tv, size_t begin, size_t end)
+{
+	bool commas = false;
+	for (size_t i = begin; i + 1 < end; i++)
+		commas |= tv[i].comma();
+	for (size_t i = begin; i < end; ) {
+		size_t last = i;
+		while (commas && last + 1 < end && !tv[last].comma())
+			last++;
+		macro.args.push_back({tv[i], uint32_t(last + 1 - i)});
+		i = last + 1;
+	}
+}
+
+/* Copies the body with each use of a parameter replaced by all the
+   tokens of its argument, on the line of the use. */
+static void splice_arguments(Macro& macro)
+{
+	auto& out = macro.expanded;
+	out.clear();
+	size_t u = 0;
+	for (size_t i = 0; i < macro.body.size(); i++) {
+		const auto tk = macro.body[i];
+		if (u < macro.uses.size() && macro.uses[u].index == i) {
+			const auto& arg = macro.args[macro.uses[u++].param];
+			const auto& src = *arg.first.stream;
+			for (uint32_t n = 0; n < arg.count; n++) {
+				const bool comma = (n + 1 == arg.count) && tk.comma();
+				out.splice(src[arg.first.index + n], tk.line(), comma);
+			}
+		} else {
+			out.splice(tk, tk.line(), tk.comma());
+		}
+	}
+}
+
+void Assembler::expand_macro(Macro& macro, const Token& name)
+{
+	if (macro.expanding)
+		token_exception(name, "Recursive macro expansion");
+	macro.args.clear();
+	if (next_on_line(name.line())) {
+		const auto first = next();
+		size_t count = 1;
+		for (; next_on_line(name.line()); count++)
+			next();
+		read_arguments(macro, *first.stream, first.index, first.index + count);
+	}
+	if (macro.args.size() != macro.params)
+		token_exception(name, "Macro expects " + std::to_string(macro.params)
+			+ " arguments, found " + std::to_string(macro.args.size()));
+
+	/* The expansion ends when the body does, or throws */
+	struct Expanding {
+		Macro& macro;
+		Expanding(Macro& m) : macro(m) { macro.expanding = true; }
+		~Expanding() { macro.expanding = false; }
+	} expanding {macro};
+
+	const bool single = std::all_of(macro.args.begin(), macro.args.end(),
+		[] (const Macro::Argument& arg) { return arg.count == 1; });
+	if (single) {
+		for (const auto& use : macro.uses)
+			macro.body.replace(use.index, macro.args[use.param].first, use.slot);
+		this->assemble(macro.body, m_realpath);
+	} else {
+		splice_arguments(macro);
+		this->assemble(macro.expanded, m_realpath);
+	}
+}
+
+void Assembler::repeat(const Token& directive)
+{
+	const auto count = resolve_constants();
+	/* An optional counter name, replaced by the iteration number */
+	std::string_view counter;
+	if (next_on_line(directive.line()))
+		counter = next<TK_SYMBOL>(" Expected counter name.").value();
+
+	TokenStream body;
+	record_body(body, ".rept", ".endr", directive);
+
+	const uint32_t slot = body.add_constant(0);
+	if (!counter.empty()) {
+		for (size_t i = 0; i < body.size(); i++) {
+			const auto tk = body[i];
+			if (tk.type() == TK_SYMBOL && tk.value() == counter)
+				body.make_constant(i, slot);
+		}
+	}
+	for (uint64_t i = 0; i < count.u64; i++) {
+		body.set_constant(slot, i);
+		this->assemble(body, m_realpath);
+	}
+}
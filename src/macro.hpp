@@ -0,0 +1,28 @@
+#pragma once
+#include "types.hpp"
+
+/* Macro bodies are lexed once, when the macro is defined. Expanding
+   a macro overwrites each use of a parameter in the body with the
+   argument token, and assembles the body as a nested token stream.
+   When an argument is more than one token, the body is copied with
+   the arguments spliced in instead. */
+struct Macro {
+	struct Use {
+		uint32_t index; /* Token in the body */
+		uint32_t param;
+		uint32_t slot;  /* Where a constant argument goes */
+	};
+	size_t params = 0;
+	TokenStream body;
+	std::vector<Use> uses;
+	/* An argument is a run of tokens on the line of the macro name */
+	struct Argument {
+		Token first;
+		uint32_t count;
+	};
+	/* Arguments of the current expansion */
+	std::vector<Argument> args;
+	/* The body with arguments of several tokens spliced in */
+	TokenStream expanded;
+	bool expanding = false;
+};
@@ -1,96 +1,189 @@
 #include "assembler.hpp"
 #include "elf128.h"
+#include "literal.hpp"
+#include "parallel.hpp"
 #include <cstring>
-#include <libgen.h>
-extern std::string load_file(const std::string&, const char* = nullptr);
+#include <algorithm>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 extern bool file_writer(const std::string&, const std::vector<uint8_t>&);
-extern std::vector<RawToken> split(const std::string&);
+extern bool layout_writer(Assembler&, const std::string&);
 static constexpr bool VERBOSE_WORDS = false;
 static constexpr bool VERBOSE_TOKENS = false;
+static constexpr bool VERBOSE_RELOCATIONS = false;
 static constexpr bool VERBOSE_GLOBALS = true;
 
-extern const char* get_realpath(const char* path) {
-	/* XXX: Intentionally leaky. */
-	char* copy = strdup(path);
-	return realpath(dirname(copy), NULL);
+static void usage(const char* program)
+{
+	fprintf(stderr, "%s [--stats] [--layout-only] [-mcmodel=any|small|pcrel] [-D name[=value] ...] [-I dir ...] [asm ...] [bin]\n", program);
+	exit(1);
 }
 
-int main(int argc, char** argv)
+/* -D name[=value], where the value defaults to 1 */
+static void add_define(Options& options, const std::string& def)
 {
-	if (argc < 3) {
-		fprintf(stderr, "%s [asm ...] [bin]\n", argv[0]);
-		exit(1);
+	const size_t eq = def.find('=');
+	const std::string name = def.substr(0, eq);
+	address_t value = 1;
+	if (eq != std::string::npos) {
+		const char* begin = def.c_str() + eq + 1;
+		const char* end = def.c_str() + def.size();
+		const auto res = parse_literal(begin, end, value);
+		if (res.ec != std::errc() || res.ptr != end || begin == end)
+			throw std::runtime_error("Invalid value for -D " + name);
 	}
-	const std::string outfile = argv[argc-1];
-
-	Options options;
-	Assembler assembler(options);
+	if (name.empty())
+		throw std::runtime_error("Missing name for -D");
+	options.defines[name] = value;
+}
 
-	for (int i = 1; i < argc-1; i++)
+static void print_stats(Assembler& assembler)
+{
+	printf("------------------ Statistics ------------------\n");
+	size_t reallocations = 0, copied = 0;
+	for (const auto& section : assembler.sections())
 	{
-		const std::string infile = argv[1];
-		auto input = load_file(infile);
-		auto tokens = Assembler::split(input);
+		const auto& stats = section.stats();
+		printf("\tSection %s\t  size %zu  estimated %zu  capacity %zu"
+			"  reallocations %zu  copied %zu\n",
+			section.name().c_str(), section.size(), stats.estimated,
+			section.output.capacity(), stats.reallocations, stats.bytes_copied);
+		reallocations += stats.reallocations;
+		copied += stats.bytes_copied;
+	}
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	printf("\tTotal\t  reallocations %zu  copied %zu  peak memory %ld kB\n",
+		reallocations, copied, usage.ru_maxrss);
+	printf("------------------ Statistics ------------------\n");
+}
 
-		if constexpr (VERBOSE_TOKENS) {
-			for (auto& token : tokens)
-				printf("Token: %s\n", token.to_string().c_str());
+static void assemble_input(Assembler& assembler, const std::string& infile)
+{
+	if (infile == "-") {
+		/* Stream from stdin, lexing on a separate thread.
+		   Includes are relative to the current directory. */
+		Conditionals conditionals {assembler.options.defines};
+		TokenQueue queue {4};
+		StreamReader reader {STDIN_FILENO, queue, conditionals};
+		assembler.assemble(queue, ".");
+		return;
+	}
+	assembler.assemble_file(infile);
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	options.verbose_tokens = VERBOSE_TOKENS;
+	options.verbose_relocations = VERBOSE_RELOCATIONS;
+	std::vector<std::string> infiles;
+	for (int i = 1; i < argc; i++)
+	{
+		const std::string arg = argv[i];
+		if (arg.size() > 2 && arg.compare(0, 2, "-D") == 0) {
+			add_define(options, arg.substr(2));
+		} else if (arg == "-D") {
+			if (++i >= argc) usage(argv[0]);
+			add_define(options, argv[i]);
+		} else if (arg.size() > 2 && arg.compare(0, 2, "-I") == 0) {
+			options.include_dirs.push_back(arg.substr(2));
+		} else if (arg == "-I") {
+			if (++i >= argc) usage(argv[0]);
+			options.include_dirs.push_back(argv[i]);
+		} else if (arg == "--stats") {
+			options.stats = true;
+		} else if (arg == "--layout-only") {
+			options.layout_only = true;
+		} else if (arg.compare(0, 9, "-mcmodel=") == 0) {
+			const std::string model = arg.substr(9);
+			if (model == "any") options.code_model = CM_ANY;
+			else if (model == "small") options.code_model = CM_SMALL;
+			else if (model == "pcrel") options.code_model = CM_PCREL;
+			else usage(argv[0]);
+		} else {
+			infiles.push_back(arg);
 		}
+	}
+	if (infiles.size() < 2) usage(argv[0]);
+	const std::string outfile = infiles.back();
+	infiles.pop_back();
+	options.files = infiles;
 
-		const char* rpath = get_realpath(infile.c_str());
-		assembler.assemble(tokens, rpath);
+	/* Each file is assembled on its own, and in parallel with the
+	   others, sharing the cache of source files. Threads take the next
+	   file as they finish one, largest first, so that a large file
+	   doesn't start last. The results are merged in command-line order. */
+	Sources sources;
+	for (const auto& dir : options.include_dirs)
+		sources.add_include_directory(dir);
+	std::vector<std::unique_ptr<Assembler>> parts(infiles.size());
+	std::vector<std::exception_ptr> errors(infiles.size());
+	std::vector<size_t> order(infiles.size());
+	for (size_t i = 0; i < order.size(); i++) order[i] = i;
+	if (order.size() > 1) {
+		std::vector<uint64_t> sizes(infiles.size(), UINT64_MAX);
+		for (size_t i = 0; i < infiles.size(); i++) {
+			struct stat st;
+			if (infiles[i] != "-" && stat(infiles[i].c_str(), &st) == 0)
+				sizes[i] = st.st_size;
+		}
+		std::stable_sort(order.begin(), order.end(),
+			[&sizes] (size_t a, size_t b) { return sizes[a] > sizes[b]; });
 	}
+	parallel_for(order.size(), 1,
+		[&] (size_t begin, size_t end) {
+			for (size_t n = begin; n < end; n++) {
+				const size_t i = order[n];
+				try {
+					parts[i] = std::make_unique<Assembler>(options, sources, i);
+					assemble_input(*parts[i], infiles[i]);
+				} catch (...) {
+					errors[i] = std::current_exception();
+				}
+			}
+		});
+	for (const auto& error : errors)
+		if (error) std::rethrow_exception(error);
 
+	Assembler& assembler = *parts.front();
+	for (size_t i = 1; i < parts.size(); i++) {
+		assembler.merge(*parts[i]);
+		parts[i] = nullptr;
+	}
 	assembler.finish();
 
+	if (options.layout_only) {
+		if (!layout_writer(assembler, outfile + ".map"))
+			throw std::runtime_error("Could not write " + outfile + ".map");
+		if (options.stats) print_stats(assembler);
+		return 0;
+	}
 	ELFwriter64(options, assembler, outfile + "64");
 	ELFwriter128(options, assembler, outfile + "128");
 
 	if constexpr (VERBOSE_GLOBALS) {
 	printf("------------------ Global symbols ------------------\n");
-	for (const auto& symbol : assembler.globals())
+	const auto& symbols = assembler.symbols();
+	for (symbol_id id = 0; id < symbols.size(); id++)
 	{
-		auto addr = assembler.address_of(symbol);
-		printf("\tGLOBAL\t  %s\t  0x%s\n",
-			symbol.c_str(),
+		if (!symbols.is_global(id)) continue;
+		const auto name = symbols.name(id);
+		auto addr = assembler.address_of(std::string(name));
+		printf("\tGLOBAL\t  %.*s\t  0x%s\n",
+			(int)name.size(), name.data(),
 			to_hex_string(addr).c_str());
 	}
 	printf("------------------ Global symbols ------------------\n");
 	}
+	if (options.stats) print_stats(assembler);
+
 	const std::string binfile = outfile + ".bin";
 	auto& text = assembler.section(".text");
 	file_writer(binfile, text.output);
 }
 
-#include <stdexcept>
-#include <unistd.h>
-std::string load_file(const std::string& filename, const char* rpath)
-{
-    size_t size = 0;
-    FILE* f = fopen(filename.c_str(), "rb");
-    if (f == NULL) {
-		if (rpath != NULL) {
-			std::string relpath = std::string(rpath) + "/" + filename;
-			f = fopen(relpath.c_str(), "rb");
-		}
-		if (f == NULL)
-		throw std::runtime_error("Could not open file: " + filename);
-	}
-    fseek(f, 0, SEEK_END);
-    size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-
-    std::string result;
-	result.resize(size);
-    if (size != fread(result.data(), 1, size, f))
-    {
-        fclose(f);
-        throw std::runtime_error("Error when reading from file: " + filename);
-    }
-    fclose(f);
-    return result;
-}
-
 bool file_writer(const std::string& filename, const std::vector<uint8_t>& bin)
 {
     FILE* f = fopen(filename.c_str(), "wb");
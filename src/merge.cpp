@@ -0,0 +1,72 @@
+#include "assembler.hpp"
+#include "expression.hpp"
+
+/* Files are assembled on their own, each into its own sections and
+   symbol table. Merging appends the sections of a file to the ones
+   with the same name, and moves its symbols and relocations along
+   with them. Nothing is resolved here, so symbols from any file are
+   found when relocations are resolved in finish(). */
+void Assembler::merge(Assembler& part)
+{
+	/* The part's sections have no addresses yet, so references
+	   from its instructions become relocations. */
+	part.encode_pending(false);
+	/* Labels still waiting for output belong at the end. */
+	for (auto& section : part.m_sections)
+		section.align_with_labels(part, 1);
+
+	struct Placement {
+		const Section* section;
+		uint64_t offset;
+	};
+	std::vector<Placement> placements;
+	placements.reserve(part.m_sections.size());
+	for (const auto& section : part.m_sections) {
+		auto& dst = this->section(section.name());
+		const size_t offset = dst.append(section);
+		placements.push_back({&dst, offset});
+	}
+
+	const auto& symbols = part.m_symbols;
+	std::vector<symbol_id> ids(symbols.size());
+	for (symbol_id id = 0; id < symbols.size(); id++) {
+		ids[id] = symbols.is_local(id) ? m_symbols.add_local(symbols.name(id))
+			: m_symbols.intern(symbols.name(id));
+		if (symbols.is_defined(id)) {
+			auto loc = symbols.location(id);
+			const auto& place = placements.at(loc.section->index());
+			loc.section = place.section;
+			loc.offset += place.offset;
+			/* Labels are shared by all files, so each name
+			   may only be defined in one of them */
+			if (!m_symbols.define(ids[id], loc))
+				throw std::runtime_error("Label defined in more than one file: "
+					+ std::string(symbols.name(id)));
+		}
+		if (symbols.is_global(id))
+			m_symbols.make_global(ids[id]);
+	}
+
+	m_relocations.reserve(m_relocations.size() + part.m_relocations.size());
+	const size_t first = m_relocations.size();
+	m_file_ranges.push_back({first, part.m_file});
+	for (const auto& range : part.m_file_ranges)
+		m_file_ranges.push_back({first + range.first, range.file});
+	const size_t programs = m_programs.size();
+	for (auto rel : part.m_relocations) {
+		const auto& place = placements.at(rel.section->index());
+		rel.section = place.section;
+		rel.offset += place.offset;
+		if (rel.expression) {
+			expr_remap(&part.m_programs[rel.symbol], ids);
+			rel.symbol += programs;
+		} else {
+			rel.symbol = ids[rel.symbol];
+		}
+		m_relocations.push_back(rel);
+	}
+	m_programs.insert(m_programs.end(),
+		part.m_programs.begin(), part.m_programs.end());
+	/* Relocations recorded later are this file's own */
+	m_file_ranges.push_back({m_relocations.size(), m_file});
+}
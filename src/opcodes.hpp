@@ -1,17 +1,49 @@
 #pragma once
-#include "assembler.hpp"
+#include "encoder.hpp"
 #include "rv32i_instr.hpp"
-#include <functional>
+#include <initializer_list>
 using Instruction = riscv::rv32i_instruction;
 
-using InstructionList = std::vector<Instruction>;
+/* Handlers return their instructions in a small buffer of fixed
+   capacity, so that encoding an instruction never allocates. The
+   longest is a 128-bit constant in a single register. */
+struct InstructionList {
+	static constexpr size_t CAPACITY = 24;
 
-struct Opcode
-{
-	std::function<InstructionList(Assembler&)> handler;
+	void push_back(Instruction instr) {
+		if (m_size >= CAPACITY) {
+			[[unlikely]];
+			throw std::runtime_error("Too many instructions for one opcode");
+		}
+		m_list[m_size++].whole = instr.whole;
+	}
+	size_t size() const noexcept { return m_size; }
+	const Instruction* begin() const noexcept { return (const Instruction *)&m_list[0]; }
+	const Instruction* end() const noexcept { return (const Instruction *)&m_list[m_size]; }
+
+	InstructionList() = default;
+	InstructionList(std::initializer_list<Instruction> list) {
+		for (const auto instr : list) push_back(instr);
+	}
+private:
+	/* Left uninitialized, as only the first m_size are used. */
+	struct Raw { uint32_t whole; };
+	Raw m_list[CAPACITY];
+	uint32_t m_size = 0;
 };
 
-struct Opcodes
+/* The shortest sequence for a constant in rd, using tmp as well when
+   that makes it shorter. See constants.cpp */
+void build_constant(InstructionList&, unsigned rd, unsigned tmp, __int128 value);
+
+struct Opcode
 {
-	static Token opcode(const std::string&);
+	InstructionList (*handler)(Encoder&);
+	/* Bytes of output, or 0 when that depends on the operands,
+	   in which case the instruction is encoded during layout. */
+	uint32_t size = 4;
+	/* Branches and jumps may grow once the layout is known */
+	bool relaxes = false;
+	/* What they relocate when they refer to a label */
+	RelocationKind relocation = R_BRANCH;
 };
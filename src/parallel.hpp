@@ -0,0 +1,116 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Worker threads that are started once, on first use, and shared by
+   every parallel phase: assembling input files, encoding runs and
+   resolving relocations. A job is a number of tasks, which are handed
+   out one at a time from an atomic counter, so a thread that is done
+   with one task takes the next one. The thread that starts a job takes
+   tasks too, which also makes it safe to start a job from a task. */
+struct ThreadPool {
+	static ThreadPool& get() {
+		static ThreadPool pool;
+		return pool;
+	}
+	/* Threads that take tasks, counting the one that starts a job */
+	size_t size() const noexcept { return m_workers.size() + 1; }
+
+	/* Calls task(i) for every i in [0, count), and returns when all
+	   of them are done. Any exception must be caught within task. */
+	void run(size_t count, const std::function<void(size_t)>& task)
+	{
+		Job job {&task, count};
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			m_jobs.push_back(&job);
+		}
+		m_work.notify_all();
+		job.work();
+
+		std::unique_lock<std::mutex> lock(m_mtx);
+		m_jobs.erase(std::find(m_jobs.begin(), m_jobs.end(), &job));
+		m_done.wait(lock, [&job] { return job.active == 0; });
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator =(const ThreadPool&) = delete;
+private:
+	struct Job {
+		const std::function<void(size_t)>* task;
+		size_t count;
+		std::atomic<size_t> next {0};
+		unsigned active = 0; /* Workers on it, guarded by the mutex */
+
+		void work() {
+			for (size_t i = next++; i < count; i = next++)
+				(*task)(i);
+		}
+	};
+
+	ThreadPool() {
+		const unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+		for (unsigned i = 1; i < cpus; i++)
+			m_workers.emplace_back([this] { this->worker(); });
+	}
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			m_stop = true;
+		}
+		m_work.notify_all();
+		for (auto& t : m_workers)
+			t.join();
+	}
+
+	Job* pending() const {
+		for (auto* job : m_jobs)
+			if (job->next < job->count) return job;
+		return nullptr;
+	}
+	void worker() {
+		std::unique_lock<std::mutex> lock(m_mtx);
+		while (true) {
+			m_work.wait(lock, [this] { return m_stop || pending() != nullptr; });
+			if (m_stop) return;
+			/* A job is only left once no worker is on it */
+			Job* job = pending();
+			job->active++;
+			lock.unlock();
+			job->work();
+			lock.lock();
+			if (--job->active == 0)
+				m_done.notify_all();
+		}
+	}
+
+	std::vector<std::thread> m_workers;
+	std::vector<Job*> m_jobs;
+	std::mutex m_mtx;
+	std::condition_variable m_work;
+	std::condition_variable m_done;
+	bool m_stop = false;
+};
+
+/* Calls func(begin, end) over contiguous runs of [0, n) on the thread
+   pool, with each run min_run long, except for the last. Small inputs
+   are handled on the calling thread. Any exception must be caught
+   within func. */
+template <typename F>
+inline void parallel_for(size_t n, size_t min_run, F&& func)
+{
+	const size_t runs = (n + min_run - 1) / min_run;
+	if (runs <= 1 || std::thread::hardware_concurrency() <= 1) {
+		func(size_t(0), n);
+		return;
+	}
+	ThreadPool::get().run(runs, [&func, n, min_run] (size_t r) {
+		func(r * min_run, std::min(n, (r + 1) * min_run));
+	});
+}
@@ -1,7 +1,34 @@
-#include <functional>
+#pragma once
+#include "keywords.hpp"
 struct Assembler;
+struct Token;
 
 struct PseudoOp
 {
-	std::function<void(Assembler&)> handler;
+	/* The token is the pseudo-op, for its line */
+	void (*handler)(Assembler&, const Token&);
+};
+
+struct PseudoOps
+{
+	static const PseudoOp DATA_8, DATA_16, DATA_32, DATA_64, DATA_128;
+	static const PseudoOp RESV_8, RESV_16, RESV_32, RESV_64, RESV_128;
+	static const PseudoOp INCBIN;
+
+	static constexpr NamedEntry<const PseudoOp*> list[] =
+	{
+		{"db",     &DATA_8},
+		{"dh",     &DATA_16},
+		{"dw",     &DATA_32},
+		{"dd",     &DATA_64},
+		{"dq",     &DATA_128},
+
+		{"resb",   &RESV_8},
+		{"resh",   &RESV_16},
+		{"resw",   &RESV_32},
+		{"resd",   &RESV_64},
+		{"resq",   &RESV_128},
+
+		{"incbin", &INCBIN},
+	};
 };
@@ -1,97 +1,107 @@
-#include "assembler.hpp"
-#include <sstream>
+#include "lexer.hpp"
 
-#define FLUSH_WORD() \
-	if (!word.empty()) {	\
-		tokens.push_back(Assembler::parse({word, line}));	\
-		word.clear();	\
+void ScalarLexer::step(size_t i)
+{
+	const char c = word.source[i];
+	if (begin_escape) {
+		/* Escaped characters never delimit words. */
+		word.append_escaped(escape_character(c));
+		begin_escape = false;
+		return;
+	}
+	if (begin_quotes) {
+		if (c == '\\') {
+			begin_escape = true;
+			return;
+		}
+		word.append(i);
+		if (c == '"') {
+			word.flush(tokens, arena, line);
+			begin_quotes = false;
+		} else if (c == '\n') line++;
+		return;
+	}
+	else if (begin_comment) {
+		if (c == '\n') {
+			begin_comment = false;
+			line++;
+		}
+		return;
 	}
+	switch (c) {
+	case ';':
+		word.flush(tokens, arena, line);
+		begin_comment = true;
+		return;
+	case '\\':
+		begin_escape = true;
+		return;
+	case '+':
+	case '-':
+	case '*':
+		/* This allows building constant chains */
+		word.flush(tokens, arena, line);
+		word.append(i);
+		break;
+	case ',':
+		word.flush(tokens, arena, line);
+		tokens.mark_comma();
+		break;
+	case ' ':
+	case '\t':
+	case '\n':
+	case '\r':
+		word.flush(tokens, arena, line);
+		if (c == '\n') line++;
+		break;
+	case '"':
+		begin_quotes = true;
+		[[fallthrough]];
+	default:
+		word.append(i);
+	}
+}
 
-static char escape_character(char echar)
+size_t ScalarLexer::run(size_t i, bool settle)
 {
-	switch (echar) {
-	case 'n': return '\n';
-	case 'r': return '\r';
-	case 't': return '\t';
-	case 'b': return '\b';
-	case '\\': return '\\';
-	case '\'': return '\'';
-	case '\"': return '\"';
-	case '0': return 0;
-	default:
-		fprintf(stderr, "Unknown escape character: %c\n", echar);
-		return echar;
+	const size_t size = word.source.size();
+	for (; i < size; i++) {
+		this->step(i);
+		if (settle && this->idle())
+			return i + 1;
 	}
+	return i;
 }
 
-std::vector<Token> Assembler::split(const std::string& s)
+void split_scalar(TokenStream& tokens, std::string_view s, StringArena& arena, uint32_t line)
 {
-	std::vector<Token> tokens;
+	ScalarLexer lexer {tokens, arena, s, line};
+	lexer.run(0, false);
+	lexer.finish();
+}
 
-	std::string word;
-	uint32_t line = 1;
-	bool begin_quotes = false;
-	bool begin_comment = false;
-	bool begin_escape = false;
-	for (char c : s)
-	{
-		bool is_escaped = false;
-		if (begin_escape) {
-			c = escape_character(c);
-			begin_escape = false;
-			is_escaped = true;
-		}
-		if (begin_quotes) {
-			if (c == '\\') {
-				begin_escape = true;
-				continue;
-			}
-			word.append(1, c);
-			if (c == '"' && !is_escaped) {
-				tokens.push_back(Assembler::parse({word, line}));
-				word.clear();
-				begin_quotes = false;
-			}
-			continue;
-		}
-		else if (begin_comment) {
-			if (c == '\n') {
-				begin_comment = false;
-				line++;
-			}
-			continue;
-		}
-		switch (c) {
-		case ';':
-			begin_comment = true;
-			continue;
-		case '\\':
-			begin_escape = true;
-			continue;
-		case '+':
-		case '-':
-		case '*':
-			/* This allows building constant chains */
-			FLUSH_WORD();
-			word.append(1, c);
-			break;
-		case ',':
-		case ' ':
-		case '\t':
-		case '\n':
-		case '\r':
-			FLUSH_WORD();
-			if (c == '\n') line++;
-			break;
-		case '"':
-			begin_quotes = true;
-			[[fallthrough]];
-		default:
-			word.append(1, c);
-		}
-	}
-	if (!word.empty())
-		tokens.push_back(Assembler::parse({word, line}));
+using split_func_t = void (*)(TokenStream&, std::string_view, StringArena&, uint32_t);
 
-    return tokens;
+static split_func_t select_lexer()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return split_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return split_sse2;
+#endif
+	return split_scalar;
+}
+
+void Assembler::split(TokenStream& tokens, std::string_view s, StringArena& arena, uint32_t line)
+{
+	static const split_func_t lexer = select_lexer();
+	lexer(tokens, s, arena, line);
+}
+TokenStream Assembler::split(std::string_view s, StringArena& arena, uint32_t line)
+{
+	TokenStream tokens;
+	Assembler::split(tokens, s, arena, line);
+	return tokens;
 }
@@ -0,0 +1,321 @@
+#include "assembler.hpp"
+#include "expression.hpp"
+#include "opcodes.hpp"
+#include <algorithm>
+#include <cstring>
+
+/* Branches reach 4 KiB, jumps 1 MiB and gp-relative addresses 2 KiB
+   of gp, which is only known once the layout is done. Each of them
+   starts out as one instruction, and those that are out of reach grow
+   to the shortest sequence that reaches, see relocation.cpp. Values of
+   expressions for set are worked out in each layout, and grow the same
+   way as laq. Growing moves everything after it, which may put other
+   branches out of reach, so the layout is redone until nothing grows.
+   Growing can also bring a target closer, past an alignment that now
+   needs less padding, and then a grown relocation shrinks back to what
+   it needs. Shrinking may in turn put others out of reach, so each
+   relocation shrinks once at most, and only one that has to grow again
+   after that is left with NOP padding. That way the layout is always
+   done after a few rounds. Alignments after code get new padding, and
+   sections after a grown one move along. */
+
+/* Addresses, loads and stores of symbols start out relative to gp,
+   and grow when their symbol is out of its reach. Programs that set up
+   gp with __global_pointer$ get it in the middle of small data, or
+   2 KiB into it, like other toolchains do. Without it, every access
+   has the AUIPC. */
+void Assembler::define_global_pointer()
+{
+	const symbol_id id = m_symbols.find("__global_pointer$");
+	if (id == SymbolTable::NONE) return;
+	m_global_pointer = id;
+	if (m_symbols.is_defined(id)) return;
+	for (const auto* name : {".sdata", ".data"}) {
+		auto it = m_section_index.find(name);
+		if (it == m_section_index.end()) continue;
+		const auto& section = m_sections[it->second];
+		m_symbols.define(id, {&section, std::min<uint64_t>(section.size() / 2, 0x800)});
+		m_symbols.make_global(id);
+		return;
+	}
+}
+
+Reach Assembler::reach_of(const Relocation& rel, address_t target) const
+{
+	/* Expressions for set are values, which the model doesn't limit */
+	Reach r {target, rel.section->address_at(rel.offset), 0, false,
+		rel.expression ? CM_ANY : options.code_model};
+	/* Setting up gp is never relative to gp, and neither are values */
+	if (m_global_pointer != SymbolTable::NONE && rel.symbol != m_global_pointer
+		&& !rel.expression && m_symbols.is_defined(m_global_pointer)) {
+		r.gp = m_symbols.location(m_global_pointer).address();
+		r.has_gp = true;
+	}
+	return r;
+}
+
+bool Assembler::reaches(const Relocation& rel, const uint8_t* programs) const
+{
+	/* Unknown symbols and other problems are reported when resolving */
+	if (rel.expression) {
+		try {
+			return rel.reaches(reach_of(rel, expr_evaluate(programs + rel.symbol, m_symbols)));
+		} catch (const std::exception&) {
+			return true;
+		}
+	}
+	if (!m_symbols.is_defined(rel.symbol)) return true;
+	return rel.reaches(reach_of(rel, m_symbols.location(rel.symbol).address()));
+}
+
+/* Whether every instruction of a run reaches its label, told from
+   the tokens alone, for when only the layout is wanted. One with an
+   expression, or more than one label, is left to the encoder. */
+bool Assembler::run_in_reach(const PendingRun& run) const
+{
+	const auto& tv = *run.tokens;
+	uint64_t offset = run.offset;
+	const uint8_t* length = m_lengths.data() + run.lengths;
+	const symbol_id* locals = m_local_ids.data() + run.locals;
+	for (size_t i = run.begin; i < run.end; ) {
+		const auto tk = tv[i];
+		if (tk.type() == TK_LABEL) {
+			i++;
+			continue;
+		}
+		const Opcode& op = *tk.opcode();
+		const size_t end = Encoder::operands_end(tv, i + 1, tk.line());
+		if (op.size == 0) {
+			/* Encoded during layout, and checked with the rest */
+			offset += *length++;
+			locals += Encoder::count_locals(tv, i + 1, end);
+			i = end;
+			continue;
+		}
+		symbol_id label = SymbolTable::NONE;
+		unsigned labels = 0;
+		for (size_t j = i + 1; j < end; j++) {
+			const auto operand = tv[j];
+			if (operand.type() == TK_OPERATOR) return false;
+			if (operand.type() != TK_SYMBOL) continue;
+			label = (operand.symbol() != SymbolTable::NONE) ? operand.symbol() : *locals++;
+			labels++;
+		}
+		if (labels > 1) return false;
+		if (labels == 1 && op.relaxes) {
+			const Relocation rel {run.section, offset, 0, label, tk.line(), op.relocation};
+			if (!this->reaches(rel, nullptr)) return false;
+		}
+		offset += op.size;
+		i = end;
+	}
+	return true;
+}
+
+bool Assembler::in_reach() const
+{
+	return std::all_of(m_relocations.begin(), m_relocations.end(),
+		[this] (const Relocation& rel) {
+			return !rel.relaxes() || this->reaches(rel, m_programs.data());
+		});
+}
+
+void Assembler::relax()
+{
+	if (this->in_reach()) return;
+
+	/* Where the output changes size, by offsets before relaxation.
+	   Everything at or after the end of a point moves. */
+	struct Point {
+		uint64_t end;
+		uint32_t index; /* Of the relocation, or the alignment */
+		bool site;      /* A relocation, rather than an alignment */
+	};
+	struct Layout {
+		std::vector<Point> points;
+		std::vector<int64_t> shifts;    /* After each point */
+		std::vector<uint32_t> paddings; /* Of each alignment */
+		bool moved = false;             /* Any shift at all */
+	};
+	std::vector<Layout> layouts(m_sections.size());
+	for (size_t i = 0; i < m_relocations.size(); i++) {
+		const auto& rel = m_relocations[i];
+		if (rel.relaxes())
+			layouts[rel.section->index()].points.push_back({rel.offset + 4, (uint32_t)i, true});
+	}
+	for (auto& section : m_sections) {
+		auto& layout = layouts[section.index()];
+		/* Alignments only change after what may grow */
+		if (layout.points.empty()) continue;
+		for (size_t i = 0; i < section.alignments.size(); i++) {
+			const auto& al = section.alignments[i];
+			layout.points.push_back({al.offset + al.padding, (uint32_t)i, false});
+		}
+		/* Relocations from the layout and from runs are not in order.
+		   A branch right before an alignment is placed first. */
+		std::stable_sort(layout.points.begin(), layout.points.end(),
+			[] (const Point& a, const Point& b) {
+				return a.end < b.end || (a.end == b.end && a.site && !b.site);
+			});
+		layout.shifts.resize(layout.points.size());
+		layout.paddings.resize(section.alignments.size());
+	}
+	/* The point of each relocation, as it moves by what is before it */
+	std::vector<uint32_t> site_points(m_relocations.size());
+	for (const auto& layout : layouts)
+		for (size_t i = 0; i < layout.points.size(); i++)
+			if (layout.points[i].site) site_points[layout.points[i].index] = i;
+	auto shift_at = [&] (const Section* section, uint64_t offset) -> int64_t {
+		const auto& layout = layouts[section->index()];
+		if (!layout.moved) return 0;
+		auto it = std::upper_bound(layout.points.begin(), layout.points.end(), offset,
+			[] (uint64_t offset, const Point& p) { return offset < p.end; });
+		if (it == layout.points.begin()) return 0;
+		return layout.shifts[it - layout.points.begin() - 1];
+	};
+	auto address_of = [&] (const Section* section, uint64_t offset) -> address_t {
+		return section->base_address() + offset + shift_at(section, offset);
+	};
+
+	const SymbolLocation* gp = nullptr;
+	if (m_global_pointer != SymbolTable::NONE && m_symbols.is_defined(m_global_pointer))
+		gp = &m_symbols.location(m_global_pointer);
+	/* The address of the symbol, or the value of the expression, in
+	   the layout being tried. False for unknown symbols and other
+	   problems, which are reported when resolving. */
+	auto target_of = [&] (const Relocation& rel, address_t& target) {
+		auto address = [&] (symbol_id id) -> address_t {
+			if (!m_symbols.is_defined(id))
+				throw std::runtime_error("Unknown symbol");
+			const auto& sym = m_symbols.location(id);
+			return address_of(sym.section, sym.offset);
+		};
+		if (!rel.expression) {
+			if (!m_symbols.is_defined(rel.symbol)) return false;
+			target = address(rel.symbol);
+			return true;
+		}
+		try {
+			target = expr_evaluate(m_programs.data() + rel.symbol, address);
+		} catch (const std::exception&) {
+			return false;
+		}
+		return true;
+	};
+	std::vector<int64_t> growth(m_sections.size());
+	/* Those that may shrink, with the words they need */
+	std::vector<std::pair<uint32_t, unsigned>> shrinking;
+	std::vector<bool> shrunk(m_relocations.size());
+	for (bool changed = true; changed; ) {
+		for (auto& section : m_sections) {
+			auto& layout = layouts[section.index()];
+			int64_t shift = 0;
+			layout.moved = false;
+			for (size_t i = 0; i < layout.points.size(); i++) {
+				const auto& p = layout.points[i];
+				if (p.site) {
+					shift += 4 * m_relocations[p.index].extra;
+				} else {
+					const auto& al = section.alignments[p.index];
+					const uint64_t start = al.offset + shift;
+					const uint32_t padding = -start & (al.alignment - 1);
+					layout.paddings[p.index] = padding;
+					shift += (int64_t)padding - al.padding;
+				}
+				layout.shifts[i] = shift;
+				layout.moved |= (shift != 0);
+			}
+			growth[section.index()] = shift;
+		}
+		this->resolve_base_addresses(growth);
+
+		bool grew = false;
+		shrinking.clear();
+		const address_t gp_address = (gp != nullptr) ? address_of(gp->section, gp->offset) : 0;
+		for (size_t i = 0; i < m_relocations.size(); i++) {
+			auto& rel = m_relocations[i];
+			address_t target;
+			if (!rel.relaxes() || !target_of(rel, target))
+				continue;
+			const auto& shifts = layouts[rel.section->index()].shifts;
+			const uint32_t point = site_points[i];
+			const address_t pc = rel.section->address_at(rel.offset)
+				+ (point != 0 ? shifts[point - 1] : 0);
+			/* Like reach_of(), in this layout */
+			const Reach r {target, pc, gp_address,
+				gp != nullptr && rel.symbol != m_global_pointer && !rel.expression,
+				rel.expression ? CM_ANY : options.code_model};
+			if (rel.reaches(r)) {
+				if (rel.extra != 0 && !shrunk[i]) {
+					const unsigned words = rel.words_needed(r);
+					if (words < rel.words())
+						shrinking.push_back({(uint32_t)i, words});
+				}
+				continue;
+			}
+			/* Those that reach nothing are reported when resolving */
+			const unsigned words = rel.words_needed(r);
+			if (words > rel.words()) {
+				rel.extra = words - 1;
+				grew = true;
+			}
+		}
+		/* Only once everything reaches, as growing moves targets */
+		if (!grew) {
+			for (const auto& [i, words] : shrinking) {
+				m_relocations[i].extra = words - 1;
+				shrunk[i] = true;
+			}
+		}
+		changed = grew || !shrinking.empty();
+	}
+
+	/* Make room in the output, with new padding for alignments */
+	for (auto& section : m_sections) {
+		auto& layout = layouts[section.index()];
+		if (layout.points.empty()) continue;
+		std::vector<uint8_t> output(section.size() + growth[section.index()]);
+		uint64_t from = 0, to = 0;
+		for (const auto& p : layout.points) {
+			uint64_t cut = p.end, skip = 0, insert;
+			if (p.site) {
+				insert = 4 * m_relocations[p.index].extra;
+			} else {
+				auto& al = section.alignments[p.index];
+				cut = al.offset;
+				skip = al.padding;
+				insert = layout.paddings[p.index];
+				al.offset = to + (cut - from);
+				al.padding = insert;
+			}
+			std::memcpy(output.data() + to, section.output.data() + from, cut - from);
+			to += cut - from + insert;
+			from = cut + skip;
+		}
+		std::memcpy(output.data() + to, section.output.data() + from, section.size() - from);
+		section.output = std::move(output);
+	}
+	/* Then move what refers to it */
+	for (symbol_id id = 0; id < m_symbols.size(); id++) {
+		if (!m_symbols.is_defined(id)) continue;
+		auto& loc = m_symbols.location(id);
+		loc.offset += shift_at(loc.section, loc.offset);
+	}
+	for (auto& rel : m_relocations)
+		rel.offset += shift_at(rel.section, rel.offset);
+	this->resolve_base_addresses();
+
+	/* Far jumps and branches that weren't given a temporary use t1,
+	   which the program may not expect to lose */
+	for (size_t i = 0; i < m_relocations.size(); i++) {
+		const auto& rel = m_relocations[i];
+		if (rel.addend != 0) continue;
+		if (rel.kind == R_BRANCH && rel.words() >= 3)
+			print_warning(file_of(i), rel.line,
+				"Far branch uses t1, name a temporary with bcc r1 r2 label, tmp");
+		else if (rel.kind == R_JAL && rel.words() >= 2
+			&& instruction_at({rel.section, rel.offset}).Jtype.rd == 0)
+			print_warning(file_of(i), rel.line,
+				"Far jump uses t1, name a temporary with jmp label, tmp");
+	}
+}
@@ -0,0 +1,600 @@
+#include "assembler.hpp"
+#include "expression.hpp"
+#include "opcodes.hpp"
+#include "instruction_list.hpp"
+#include "parallel.hpp"
+#include <elf.h>
+#include <cstring>
+#include <mutex>
+static constexpr unsigned REG_RA = 1;
+static constexpr unsigned REG_GP = 3; /* Of small data, see relax.cpp */
+static constexpr unsigned REG_T1 = 6; /* Temporary of far jumps without one */
+
+static bool jal_reaches(__int128 diff)
+{
+	return diff >= -(1 << 20) && diff < (1 << 20);
+}
+static bool branch_reaches(__int128 diff)
+{
+	return diff >= -4096 && diff < 4096;
+}
+/* AUIPC + JALR, where the low 12 bits are sign-extended */
+static bool pair_reaches(__int128 diff)
+{
+	return diff >= INT32_MIN && diff < (__int128)INT32_MAX - 0x7FF;
+}
+static void bounds_check_reach(int64_t diff, bool reaches, const char* what)
+{
+	if (!reaches) {
+		[[unlikely]];
+		throw std::runtime_error(std::string("Out of bounds address for ")
+			+ what + ": " + std::to_string(diff));
+	}
+}
+
+static void set_uint32(Assembler& a,
+	const SymbolLocation& loc, uint32_t offset, int32_t value)
+{
+	auto& i1 = a.instruction_at(loc, offset+0);
+	auto& i2 = a.instruction_at(loc, offset+4);
+	i2.Itype.imm = value;
+	i1.Utype.imm = (value + i2.Itype.imm) >> 12;
+}
+static void set_jtype(Instruction& instr, int32_t diff)
+{
+	instr.Jtype.imm3 = diff >> 1;
+	instr.Jtype.imm2 = diff >> 11;
+	instr.Jtype.imm1 = diff >> 12;
+	instr.Jtype.imm4 = diff >> 20;
+}
+static void set_btype(Instruction& instr, int32_t diff)
+{
+	instr.Btype.imm2 = diff >> 1;
+	instr.Btype.imm3 = diff >> 5;
+	instr.Btype.imm1 = diff >> 11;
+	instr.Btype.imm4 = diff >> 12;
+}
+
+/* The sequences that relaxing relocations take, from one instruction
+   up, where the first one is where the relocation was recorded:
+
+     branch:   bcc label
+               b!cc +8;  jal zero, label
+               b!cc +12; auipc t1, hi; jalr zero, t1, lo
+     jump:     jal rd, label
+               auipc rd, hi; jalr rd, rd, lo
+     la:       addi rd, gp, lo
+               auipc rd, hi; addi rd, rd, lo
+               lui rd, hi; addi rd, rd, lo
+     laq:      like la, and then four or eight instructions for two or
+               four chunks of 32 bits, the last ones in the temporary,
+               shifted and added into rd
+     farcall:  jal ra, label, or like laq into the register, and then
+               jalr ra, reg, lo
+     loads and stores are like la, with the access in place of ADDI
+
+   Jumps without a return address, far branches and stores use the
+   temporary they were given, which is t1 for jumps and branches
+   without one. The code model decides which of them may be used.
+   Each relocation takes the longest sequence that reaches and fits in
+   the room it has, which relaxation sizes to the shortest that reaches.
+   Only one that had to grow again after shrinking, see relax.cpp, may
+   have more room than that, and the rest of it is NOP padding. */
+enum Form : uint8_t {
+	F_BRANCH,
+	F_BRANCH_JAL,
+	F_BRANCH_FAR,
+	F_JAL,
+	F_GP,
+	F_PCREL,
+	F_ABS32,
+	F_ABS64,
+	F_ABS128,
+	F_NONE,
+};
+struct FormList {
+	const Form* first;
+	const Form* last;
+};
+static FormList forms_of(RelocationKind kind)
+{
+	static constexpr Form branch[] {F_BRANCH, F_BRANCH_JAL, F_BRANCH_FAR};
+	static constexpr Form jump[] {F_JAL, F_PCREL};
+	static constexpr Form access[] {F_GP, F_PCREL, F_ABS32};
+	static constexpr Form address[] {F_GP, F_PCREL, F_ABS32, F_ABS64, F_ABS128};
+	static constexpr Form call[] {F_JAL, F_PCREL, F_ABS32, F_ABS64, F_ABS128};
+	switch (kind) {
+	case R_BRANCH:  return {std::begin(branch), std::end(branch)};
+	case R_JAL:     return {std::begin(jump), std::end(jump)};
+	case R_LAQ:     return {std::begin(address), std::end(address)};
+	case R_FARCALL: return {std::begin(call), std::end(call)};
+	default:        return {std::begin(access), std::end(access)};
+	}
+}
+static unsigned words_of(Form form, RelocationKind kind)
+{
+	switch (form) {
+	case F_BRANCH:
+	case F_JAL:
+	case F_GP:
+		return 1;
+	case F_BRANCH_FAR:
+		return 3;
+	case F_ABS64:
+		return (kind == R_FARCALL) ? 7 : 6;
+	case F_ABS128:
+		return (kind == R_FARCALL) ? 15 : 14;
+	default:
+		return 2;
+	}
+}
+
+/* The low 12 bits are sign-extended, so a LUI + ADDI pair holds
+   [-2^31 - 2048, 2^31 - 2048). This is the part of the value that
+   goes in the lowest pair, and the rest is shifted down 32 bits. */
+static int64_t chunk_of(__int128 value)
+{
+	return (int64_t)(uint32_t)((uint64_t)value + 0x80000800) - 0x80000800;
+}
+static int32_t low12(__int128 value)
+{
+	return (int32_t)((uint32_t)value << 20) >> 20;
+}
+
+static bool form_reaches(Form form, RelocationKind kind, const Reach& r)
+{
+	const __int128 diff = (__int128)(r.target - r.pc);
+	switch (form) {
+	case F_BRANCH:
+		return branch_reaches(diff);
+	/* Relaxed branches are inverted to skip over the jump */
+	case F_BRANCH_JAL:
+		return jal_reaches(diff - 4);
+	case F_BRANCH_FAR:
+		return pair_reaches(diff - 4);
+	case F_JAL:
+		return jal_reaches(diff);
+	case F_GP: {
+		const __int128 gpdiff = (__int128)(r.target - r.gp);
+		return r.has_gp && gpdiff >= -2048 && gpdiff < 2048;
+		}
+	case F_PCREL:
+		/* Only code may be PC-relative in the small model */
+		if (r.model == CM_SMALL && kind != R_JAL && kind != R_FARCALL)
+			return false;
+		return pair_reaches(diff);
+	case F_ABS32:
+		return r.model != CM_PCREL && pair_reaches((__int128)r.target);
+	case F_ABS64: {
+		const __int128 value = (__int128)r.target;
+		const __int128 high = (value - chunk_of(value)) >> 32;
+		return r.model == CM_ANY && chunk_of(high) == high;
+		}
+	case F_ABS128:
+		return r.model == CM_ANY;
+	default:
+		return false;
+	}
+}
+
+/* The longest form that reaches in at most the given words */
+static Form choose_form(RelocationKind kind, const Reach& r, unsigned words)
+{
+	const auto list = forms_of(kind);
+	/* Most have the one instruction they started out with */
+	if (words == 1)
+		return form_reaches(*list.first, kind, r) ? *list.first : F_NONE;
+	Form best = F_NONE;
+	unsigned best_words = 0;
+	for (auto* f = list.first; f != list.last; f++) {
+		const unsigned n = words_of(*f, kind);
+		if (n <= words && n > best_words && form_reaches(*f, kind, r)) {
+			best = *f;
+			best_words = n;
+		}
+	}
+	return best;
+}
+
+bool Relocation::reaches(const Reach& r) const noexcept
+{
+	return choose_form(kind, r, words()) != F_NONE;
+}
+
+unsigned Relocation::words_needed(const Reach& r) const noexcept
+{
+	const auto list = forms_of(kind);
+	for (auto* f = list.first; f != list.last; f++)
+		if (form_reaches(*f, kind, r)) return words_of(*f, kind);
+	return 0;
+}
+
+const char* Relocation::to_string(RelocationKind kind)
+{
+	switch (kind) {
+	case R_LA:      return "LA";
+	case R_LAQ:     return "LAQ";
+	case R_FARCALL: return "FARCALL";
+	case R_JAL:     return "JAL";
+	case R_BRANCH:  return "BRANCH";
+	case R_LI:      return "LI";
+	case R_IMM:     return "IMM";
+	case R_STORE:   return "STORE";
+	case R_SYMLOAD: return "SYMLOAD";
+	case R_SYMSTORE: return "SYMSTORE";
+	case R_DATA:    return "DATA";
+	case R_SIZE:    return "SIZE";
+	case R_ENDFUNC: return "ENDFUNC";
+	case R_TYPE:    return "TYPE";
+	}
+	return "Unknown";
+}
+
+void Assembler::relocate(RelocationKind kind, const Token& tk, int32_t addend)
+{
+	const symbol_id id = (tk.symbol() != SymbolTable::NONE)
+		? tk.symbol() : bind_reference(tk);
+	m_relocations.push_back(Relocation{m_current_section,
+		m_current_section->size(), addend, id, tk.line(), kind});
+}
+
+bool data_fits(__uint128_t value, size_t size, std::string& problem)
+{
+	if (size >= sizeof(value)) return true;
+	const unsigned bits = 8 * size;
+	if ((value >> bits) == 0 || ((__int128_t)value >> (bits - 1)) == -1)
+		return true;
+	problem = "Out of bounds value for " + std::to_string(bits)
+		+ "-bit data: 0x" + to_hex_string(value);
+	return false;
+}
+
+static void bounds_check_imm(__int128 value, __int128 min, __int128 max, const char* what)
+{
+	if (value < min || value > max) {
+		[[unlikely]];
+		throw std::runtime_error(std::string("Out of bounds ") + what
+			+ ": " + std::to_string((int64_t)value));
+	}
+}
+
+static Instruction upper(uint32_t opcode, unsigned rd, __int128 value)
+{
+	Instruction instr(opcode);
+	instr.Utype.rd = rd;
+	instr.Utype.imm = (value - low12(value)) >> 12;
+	return instr;
+}
+/* LUI + ADDI of a chunk, see chunk_of() */
+static void push_chunk(InstructionList& il, unsigned rd, int64_t chunk)
+{
+	Instruction add(RV32I_OP_IMM);
+	add.Itype.rd = rd;
+	add.Itype.rs1 = rd;
+	add.Itype.imm = chunk;
+	il.push_back(upper(RV32I_LUI, rd, chunk));
+	il.push_back(add);
+}
+
+static const char* what_of(RelocationKind kind)
+{
+	switch (kind) {
+	case R_LA:       return "la";
+	case R_LAQ:      return "laq";
+	case R_FARCALL:  return "farcall";
+	case R_JAL:      return "jump";
+	case R_BRANCH:   return "branch";
+	case R_SYMLOAD:  return "load";
+	default:         return "store";
+	}
+}
+
+/* Writes the sequence that reaches the value, see forms_of() */
+static void patch_form(Assembler& a, const Relocation& rel, address_t value)
+{
+	const SymbolLocation loc {rel.section, rel.offset};
+	const Reach r = a.reach_of(rel, value);
+	const Form form = choose_form(rel.kind, r, rel.words());
+	const __int128 diff = (__int128)(value - r.pc);
+	bounds_check_reach(diff, form != F_NONE, what_of(rel.kind));
+	if (rel.words() == 1 && (form == F_BRANCH || form == F_JAL)) {
+		/* Most are patched in place */
+		auto& instr = a.instruction_at(loc);
+		if (form == F_BRANCH)
+			set_btype(instr, diff);
+		else
+			set_jtype(instr, diff);
+		return;
+	}
+	const Instruction first = a.instruction_at(loc);
+
+	/* The register that holds the address, and the instruction
+	   that adds the low 12 bits of it */
+	unsigned base;
+	Instruction use = first;
+	switch (rel.kind) {
+	case R_LA:
+	case R_LAQ:
+	case R_SYMLOAD:
+		base = first.Itype.rd;
+		break;
+	case R_SYMSTORE:
+		base = rel.addend;
+		break;
+	case R_FARCALL:
+		base = rel.addend;
+		use = Instruction(RV32I_JALR);
+		use.Itype.rd = REG_RA;
+		break;
+	case R_JAL:
+		base = (first.Jtype.rd != 0) ? first.Jtype.rd
+			: (rel.addend != 0) ? rel.addend : REG_T1;
+		use = Instruction(RV32I_JALR);
+		use.Itype.rd = first.Jtype.rd;
+		break;
+	default:
+		base = (rel.addend != 0) ? rel.addend : REG_T1;
+		use = Instruction(RV32I_JALR);
+		break;
+	}
+	auto low = [&] (unsigned rs1, int32_t lo) {
+		use.Itype.rs1 = rs1;
+		if (rel.kind == R_SYMSTORE) {
+			use.Stype.imm1 = lo;
+			use.Stype.imm2 = lo >> 5;
+		} else {
+			use.Itype.imm = lo;
+		}
+		return use;
+	};
+
+	InstructionList il;
+	Instruction instr = first;
+	switch (form) {
+	case F_BRANCH:
+		set_btype(instr, diff);
+		il.push_back(instr);
+		break;
+	case F_BRANCH_JAL:
+	case F_BRANCH_FAR:
+		/* The opposite condition skips over the jump */
+		instr.Btype.funct3 ^= 1;
+		set_btype(instr, 4 * words_of(form, rel.kind));
+		il.push_back(instr);
+		if (form == F_BRANCH_JAL) {
+			Instruction jump(RV32I_JAL);
+			set_jtype(jump, diff - 4);
+			il.push_back(jump);
+		} else {
+			il.push_back(upper(RV32I_AUIPC, base, diff - 4));
+			il.push_back(low(base, low12(diff - 4)));
+		}
+		break;
+	case F_JAL:
+		set_jtype(instr, diff);
+		il.push_back(instr);
+		break;
+	case F_GP:
+		il.push_back(low(REG_GP, value - r.gp));
+		break;
+	case F_PCREL:
+		il.push_back(upper(RV32I_AUIPC, base, diff));
+		il.push_back(low(base, low12(diff)));
+		break;
+	case F_ABS32:
+		il.push_back(upper(RV32I_LUI, base, value));
+		il.push_back(low(base, low12(value)));
+		break;
+	default: {
+		/* The highest chunk goes into the register, and the others
+		   into the temporary, to be shifted and added in turn. */
+		const unsigned count = (form == F_ABS64) ? 2 : 4;
+		const unsigned tmp = (rel.kind == R_FARCALL) ? REG_RA : rel.addend;
+		if (tmp == base || tmp == 0) {
+			[[unlikely]];
+			throw std::runtime_error(std::string("Out of bounds address for ")
+				+ what_of(rel.kind) + " without a temporary register");
+		}
+		int64_t chunks[4];
+		__int128 rest = value;
+		for (unsigned i = 0; i < count; i++) {
+			chunks[i] = chunk_of(rest);
+			rest = (rest - chunks[i]) >> 32;
+		}
+		push_chunk(il, base, chunks[count-1]);
+		for (unsigned i = count-1; i-- > 0; ) {
+			push_chunk(il, tmp, chunks[i]);
+			Instruction shift(RV32I_OP_IMM);
+			shift.Itype.rd = base;
+			shift.Itype.rs1 = base;
+			shift.Itype.funct3 = 0x1;
+			shift.Itype.imm = 32;
+			il.push_back(shift);
+			Instruction add(RV32I_OP);
+			add.Rtype.rd = base;
+			add.Rtype.rs1 = base;
+			add.Rtype.rs2 = tmp;
+			il.push_back(add);
+		}
+		if (rel.kind == R_FARCALL)
+			il.push_back(low(base, 0));
+		} break;
+	}
+
+	uint32_t offset = 0;
+	for (const auto& i : il) {
+		a.instruction_at(loc, offset) = i;
+		offset += 4;
+	}
+	/* What is left of the room, see above */
+	for (; offset < 4 * rel.words(); offset += 4)
+		a.instruction_at(loc, offset) = Instruction(RV32I_OP_IMM);
+}
+
+/* Completes the output at the relocation with the value, which is
+   the address of the symbol or the value of the expression. */
+static void patch(Assembler& a, const Relocation& rel, address_t value)
+{
+	const SymbolLocation loc {rel.section, rel.offset};
+	switch (rel.kind) {
+	case R_LA:
+	case R_LAQ:
+	case R_FARCALL:
+	case R_JAL:
+	case R_BRANCH:
+	case R_SYMLOAD:
+	case R_SYMSTORE:
+		patch_form(a, rel, value);
+		break;
+	case R_LI:
+		/* Like li with a constant, either sign works */
+		bounds_check_imm(value, INT32_MIN, UINT32_MAX, "value for li");
+		set_uint32(a, loc, 0, value);
+		break;
+	case R_IMM:
+		bounds_check_imm(value, -2048, 2047, "immediate value");
+		a.instruction_at(loc).Itype.imm = value;
+		break;
+	case R_STORE: {
+		bounds_check_imm(value, -2048, 2047, "immediate value");
+		auto& instr = a.instruction_at(loc);
+		instr.Stype.imm1 = value;
+		instr.Stype.imm2 = value >> 5;
+		} break;
+	case R_DATA: {
+		std::string problem;
+		if (!data_fits(value, rel.addend, problem)) {
+			[[unlikely]];
+			throw std::runtime_error(problem);
+		}
+		std::memcpy(&a.at_location<uint8_t>(loc), &value, rel.addend);
+		} break;
+	default:
+		break;
+	}
+}
+
+static void update(Assembler& a, const Relocation& rel, SymbolLocation& sym)
+{
+	const SymbolLocation loc {rel.section, rel.offset};
+	switch (rel.kind) {
+	case R_SIZE: {
+		/* The size is aligned, while the data it measures
+		   ends where the padding begins. */
+		auto& size = a.at_location<uint32_t>(loc);
+		const address_t dataloc = loc.address() - rel.addend;
+		if (sym.address() < dataloc)
+			size = dataloc - sym.address(); /* NB: Opposite */
+		else
+			size = sym.address() - 4 - loc.address(); /* NB: Forward */
+		sym.size = size;
+		} break;
+	case R_ENDFUNC:
+		sym.size = loc.address() - sym.address();
+		sym.type = STT_FUNC;
+		break;
+	case R_TYPE:
+		sym.type = rel.addend;
+		break;
+	default:
+		break;
+	}
+}
+
+void Assembler::resolve(const Relocation& rel, const uint8_t* programs)
+{
+	if (rel.expression) {
+		::patch(*this, rel, expr_evaluate(programs + rel.symbol, m_symbols));
+		return;
+	}
+	if (!m_symbols.is_defined(rel.symbol))
+		throw std::runtime_error("Unknown symbol scheduled: "
+			+ std::string(m_symbols.name(rel.symbol)));
+	if (rel.updates_symbol())
+		::update(*this, rel, m_symbols.location(rel.symbol));
+	else
+		::patch(*this, rel, m_symbols.location(rel.symbol).address());
+}
+
+/* Relocations that update symbols are resolved first, in the order
+   they were recorded. The rest are split by index into runs for the
+   thread pool. Merged files and encoded runs append theirs out of
+   program order, so a run may cover any part of any section, but each
+   relocation only patches the bytes of its own instruction or data,
+   and no two relocations share those. Problems are collected and
+   reported ordered by file and line, no matter which thread found
+   them. With symbols_only, only the relocations that update symbols
+   are resolved, for a layout without instructions. */
+void Assembler::finish_relocations(bool symbols_only)
+{
+	static constexpr size_t MIN_RUN = 65536;
+	std::vector<Problem> problems;
+	std::mutex problems_mtx;
+
+	auto resolve_run = [&] (size_t begin, size_t end, bool updates_symbols) {
+		for (size_t i = begin; i < end; i++) {
+			const auto& rel = m_relocations[i];
+			if (rel.updates_symbol() != updates_symbols) continue;
+			try {
+				this->resolve(rel, m_programs.data());
+			} catch (const std::exception& e) {
+				std::lock_guard<std::mutex> lock(problems_mtx);
+				problems.push_back({file_of(i), rel.line, i, e.what()});
+			}
+		}
+	};
+
+	if (options.verbose_relocations) {
+		for (const auto& rel : m_relocations) {
+			const auto name = rel.expression ? std::string_view("<expression>")
+				: m_symbols.name(rel.symbol);
+			printf("Relocation %s %.*s at line %u\n",
+				Relocation::to_string(rel.kind), (int)name.size(), name.data(),
+				rel.line);
+		}
+	}
+
+	resolve_run(0, m_relocations.size(), true);
+	if (!symbols_only) {
+		parallel_for(m_relocations.size(), MIN_RUN,
+			[&] (size_t begin, size_t end) {
+				resolve_run(begin, end, false);
+			});
+	}
+
+	if (!problems.empty())
+		report(problems);
+}
+
+void Assembler::report(std::vector<Problem>& problems) const
+{
+	std::sort(problems.begin(), problems.end());
+	for (const auto& p : problems)
+		if (!p.reported) print_problem(p.file, p.line, p.what);
+	throw std::runtime_error(problems.front().what);
+}
+
+static void print_diagnostic(const Options& options, const char* kind,
+	uint32_t file, uint32_t line, const std::string& info)
+{
+	if (options.files.size() > 1 && file < options.files.size())
+		fprintf(stderr, "*** %s in %s on line %u: %s\n", kind,
+			options.files[file].c_str(), line, info.c_str());
+	else
+		fprintf(stderr, "*** %s on line %u: %s\n", kind, line, info.c_str());
+}
+void Assembler::print_problem(uint32_t file, uint32_t line, const std::string& info) const
+{
+	print_diagnostic(options, "Problem", file, line, info);
+}
+void Assembler::print_warning(uint32_t file, uint32_t line, const std::string& info) const
+{
+	print_diagnostic(options, "Warning", file, line, info);
+}
+
+uint32_t Assembler::file_of(size_t relocation) const
+{
+	auto it = std::upper_bound(m_file_ranges.begin(), m_file_ranges.end(), relocation,
+		[] (size_t i, const FileRange& range) { return i < range.first; });
+	return (it == m_file_ranges.begin()) ? m_file : std::prev(it)->file;
+}
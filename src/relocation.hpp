@@ -0,0 +1,76 @@
+#pragma once
+#include "types.hpp"
+
+enum RelocationKind : uint8_t {
+	R_LA,       /* Address of a symbol, see relocation.cpp */
+	R_LAQ,      /* Address of up to 128 bits, addend is the temporary */
+	R_FARCALL,  /* Call through a register, addend is the register */
+	R_JAL,      /* JAL, or AUIPC + JALR when relaxed, addend is the temporary */
+	R_BRANCH,   /* Conditional branch, addend is the temporary, see relax.cpp */
+	R_LI,       /* LUI + ADDI, absolute 32-bit value */
+	R_IMM,      /* I-type 12-bit immediate */
+	R_STORE,    /* S-type 12-bit immediate */
+	R_SYMLOAD,  /* Load from a symbol, gp-relative or AUIPC + load */
+	R_SYMSTORE, /* Store to a symbol, addend is the temporary register */
+	R_DATA,     /* Data, addend is the width in bytes */
+	/* The kinds below also update the symbol */
+	R_SIZE,     /* 32-bit size of the symbol, addend is alignment padding */
+	R_ENDFUNC,  /* Symbol becomes a function ending here */
+	R_TYPE,     /* Symbol type, addend is the type */
+};
+
+/* The sequences that addresses may take, from -mcmodel */
+enum CodeModel : uint8_t {
+	CM_ANY,    /* Whichever is shortest, up to 128-bit absolute */
+	CM_SMALL,  /* Absolute, in the lowest (or highest) 2 GB */
+	CM_PCREL,  /* Relative to the instruction, within 2 GB */
+};
+
+/* Where a relocation is, and what it refers to, once laid out */
+struct Reach {
+	address_t target;
+	address_t pc;
+	address_t gp;
+	bool has_gp;
+	CodeModel model;
+};
+
+/* A reference to a symbol that can only be completed once every
+   symbol has an address. The location is the section and offset
+   of the first instruction (or data) to fix up. */
+struct Relocation {
+	const Section* section;
+	uint64_t offset;
+	int32_t  addend;
+	symbol_id symbol;
+	uint32_t line; /* For diagnostics */
+	RelocationKind kind;
+	/* The value is an expression, and the symbol is the offset
+	   of its bytecode in the program pool. See expression.hpp */
+	bool expression = false;
+	/* Instructions added to the first, when it is out of reach */
+	uint8_t extra = 0;
+
+	/* Kinds that change the symbol, rather than just the output */
+	bool updates_symbol() const noexcept { return kind >= R_SIZE; }
+	/* Branches, jumps, addresses and accesses that start out as one
+	   instruction, and grow when their symbol is far away. Expressions
+	   for set grow like laq, to what their value needs. See relax.cpp */
+	bool relaxes() const noexcept {
+		return kind == R_LA || kind == R_LAQ || kind == R_FARCALL
+			|| kind == R_BRANCH || kind == R_JAL
+			|| kind == R_SYMLOAD || kind == R_SYMSTORE;
+	}
+	/* Instructions there is room for */
+	unsigned words() const noexcept { return 1 + extra; }
+	/* Whether a sequence that fits reaches the target */
+	bool reaches(const Reach&) const noexcept;
+	/* The fewest instructions that reach the target, or 0 if none do */
+	unsigned words_needed(const Reach&) const noexcept;
+	static const char* to_string(RelocationKind);
+};
+static_assert(sizeof(Relocation) <= 32, "Relocations are meant to be compact");
+
+/* Whether a value fits in data of the given size in bytes, either as
+   a signed or as an unsigned number. Returns the problem otherwise. */
+extern bool data_fits(__uint128_t value, size_t size, std::string& problem);
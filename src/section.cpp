@@ -1,44 +1,85 @@
 #include "section.hpp"
 #include "assembler.hpp"
+#include <algorithm>
+#include <cstring>
 
 void Section::set_base_address(address_t nba) noexcept {
 	m_base_address = nba;
 	m_has_base_addr = true;
 }
 
-void Section::add_label_soon(const std::string& name) {
-	m_label_queue.push_back(name);
+void Section::add_label_soon(symbol_id label) {
+	m_label_queue.push_back(label);
 }
-void Section::add_label_here(Assembler& a, const std::string& label) {
+void Section::add_label_here(Assembler& a, symbol_id label) {
 	if (a.options.verbose_labels) {
-	printf("Label %s at %s off 0x%s\n",
-		label.c_str(), name().c_str(), to_hex_string(current_address()).c_str());
+	const auto lname = a.symbols().name(label);
+	printf("Label %.*s at %s off 0x%s\n", (int)lname.size(), lname.data(),
+		name().c_str(), to_hex_string(current_address()).c_str());
 	}
-	/* TODO: Check for duplicate labels */
 	a.add_symbol_here(label);
 }
 
 void Section::add_output(OutputType type, const void* vdata, size_t len) {
-	const char* data = (const char*)vdata;
-	output.insert(output.end(), data, data + len);
-	if (type == OT_CODE) this->code = true;
-	else if (type == OT_DATA) this->data = true;
-	else if (type == OT_RESV) this->resv = true;
+	if (len > 0)
+		std::memcpy(this->extend(type, len), vdata, len);
 }
 void Section::allocate(size_t len) {
-	output.resize(output.size() + len);
+	this->grow(len);
 	this->resv = true;
 }
 void Section::align(size_t alignment) {
 	size_t newsize = (output.size() + (alignment-1)) & ~(alignment-1);
+	if (this->records(alignment))
+		alignments.push_back({output.size(), (uint32_t)alignment,
+			(uint32_t)(newsize - output.size())});
 	if (output.size() != newsize)
-		output.resize(newsize);
+		this->grow(newsize - output.size());
 }
-void Section::align_with_labels(Assembler& a, size_t alignment)
+size_t Section::append(const Section& other) {
+	/* Later parts can't move the section with an .org of their own */
+	if (other.has_base_address() && this->size() > 0
+		&& (!this->has_base_address() || this->base_address() != other.base_address()))
+		throw std::runtime_error("Cannot change base address of " + name()
+			+ " in a file after the first one that adds to it");
+	/* The parts of different files are 16-byte aligned, like sections. */
+	this->align(16);
+	const size_t offset = this->size();
+	if (!other.output.empty())
+		std::memcpy(this->grow(other.size()), other.output.data(), other.size());
+	for (auto al : other.alignments) {
+		al.offset += offset;
+		this->alignments.push_back(al);
+	}
+	this->code |= other.code;
+	this->data |= other.data;
+	this->resv |= other.resv;
+	this->execonly |= other.execonly;
+	this->readonly |= other.readonly;
+	/* An .org in the first part that adds to a section counts */
+	if (offset == 0 && other.has_base_address())
+		this->set_base_address(other.base_address());
+	return offset;
+}
+void Section::reserve(size_t len) {
+	m_stats.estimated += len;
+	if (output.size() + len > output.capacity())
+		this->reallocate(output.size() + len);
+}
+void Section::reallocate(size_t capacity) {
+	/* At least double, so that growing stays amortized O(1). */
+	capacity = std::max(capacity, 2 * output.capacity());
+	if (!output.empty()) {
+		m_stats.reallocations++;
+		m_stats.bytes_copied += output.size();
+	}
+	output.reserve(capacity);
+}
+void Section::align_and_add_labels(Assembler& a, size_t alignment)
 {
 	if (alignment > 1)
 		this->align(alignment);
-	for (const auto& name : m_label_queue)
-		add_label_here(a, name);
+	for (const auto label : m_label_queue)
+		add_label_here(a, label);
 	m_label_queue.clear();
 }
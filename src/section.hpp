@@ -18,17 +18,30 @@ struct SymbolLocation {
 
 struct Section {
 	address_t base_address() const noexcept { return m_base_address; }
+	/* Whether the base address was given, rather than placed */
 	bool has_base_address() const noexcept { return m_has_base_addr; }
 	void set_base_address(address_t nba) noexcept;
+	/* Place a section without a given base address, which may
+	   happen again when the layout changes. */
+	void place_at(address_t addr) noexcept { m_base_address = addr; }
 	address_t current_address() const noexcept { return base_address() + size(); }
 	SymbolLocation current_location() const noexcept { return {this, size()}; }
 
 	address_t address_at(uint64_t offset) const noexcept { return m_base_address + offset; }
 
 	void add_output(OutputType, const void* vdata, size_t len);
+	/* Grow the output by len zeroed bytes, and return them. */
+	uint8_t* extend(OutputType, size_t len);
+	/* Make room for len more bytes, as estimated from tokens. */
+	void reserve(size_t len);
 	void allocate(size_t len);
 	void align(size_t alignment);
-	void align_with_labels(Assembler&, size_t alignment);
+	void align_with_labels(Assembler& a, size_t alignment) {
+		/* Almost always there is nothing to do. */
+		if (!m_label_queue.empty() || (size() & (alignment-1)) != 0
+			|| records(alignment))
+			align_and_add_labels(a, alignment);
+	}
 	void make_execonly() { this->execonly = true; }
 	void make_readonly() { this->readonly = true; }
 
@@ -36,10 +49,30 @@ struct Section {
 	int index() const noexcept { return m_idx; }
 	size_t size() const noexcept { return output.size(); }
 
-	void add_label_soon(const std::string& name);
-	void add_label_here(Assembler&, const std::string& name);
+	struct Stats {
+		size_t estimated = 0;     /* Bytes expected from tokens */
+		size_t reallocations = 0;
+		size_t bytes_copied = 0;  /* By reallocations */
+	};
+	const Stats& stats() const noexcept { return m_stats; }
+
+	/* Append the contents of a section with the same name from another
+	   file, starting at the returned offset. */
+	size_t append(const Section&);
+
+	void add_label_soon(symbol_id);
+	void add_label_here(Assembler&, symbol_id);
 
 	std::vector<uint8_t> output;
+	/* Alignments where branches that grow before them change the
+	   padding. Instructions grow by whole instructions, and parts
+	   from other files are 16-byte aligned, see append(). */
+	struct Alignment {
+		uint64_t offset;    /* Where the padding starts */
+		uint32_t alignment;
+		uint32_t padding;
+	};
+	std::vector<Alignment> alignments;
 	bool code = false;
 	bool data = false;
 	bool resv = false;
@@ -48,13 +81,39 @@ struct Section {
 
 	Section(const std::string& name, int idx) : m_name{name}, m_idx{idx} {}
 private:
+	void align_and_add_labels(Assembler&, size_t alignment);
+	bool records(size_t alignment) const noexcept {
+		return alignment > 16 || (alignment > 4 && code);
+	}
+	uint8_t* grow(size_t len);
+	void reallocate(size_t capacity);
+
 	std::string m_name;
 	const int   m_idx;
 	bool m_has_base_addr = false;
-	std::vector<std::string> m_label_queue;
+	std::vector<symbol_id> m_label_queue;
 	address_t m_base_address = 0;
+	Stats m_stats;
 };
 
+/* All growth goes through here, so that reallocations are counted. */
+inline uint8_t* Section::grow(size_t len) {
+	const size_t offset = output.size();
+	if (offset + len > output.capacity()) {
+		[[unlikely]];
+		this->reallocate(offset + len);
+	}
+	output.resize(offset + len);
+	return output.data() + offset;
+}
+inline uint8_t* Section::extend(OutputType type, size_t len) {
+	uint8_t* dst = this->grow(len);
+	if (type == OT_CODE) this->code = true;
+	else if (type == OT_DATA) this->data = true;
+	else if (type == OT_RESV) this->resv = true;
+	return dst;
+}
+
 inline address_t SymbolLocation::address() const noexcept {
 	return section->address_at(offset);
 }
@@ -0,0 +1,213 @@
+#include "lexer.hpp"
+#if defined(__x86_64__) || defined(__i386__)
+#include <cstring>
+#include <immintrin.h>
+#define AVX2_TARGET __attribute__((target("avx2,popcnt")))
+
+static inline bool is_blank(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+static inline bool is_special(char c) {
+	return is_blank(c) || c == ',' || c == ';' || c == '"' || c == '\\'
+		|| c == '+' || c == '-' || c == '*';
+}
+
+/* Scanners classify a whole vector of bytes at a time. Blanks are
+   the word delimiters, and specials are everything that ends a run
+   of plain word characters. Newlines are counted as they are skipped.
+   Commas are delimiters too, but are not skipped as blanks, so that
+   the token before them can be marked. */
+struct SSE2Scanner {
+	static __m128i eq(__m128i v, char c) {
+		return _mm_cmpeq_epi8(v, _mm_set1_epi8(c));
+	}
+	static __m128i blanks(__m128i v) {
+		__m128i m = _mm_or_si128(eq(v, ' '), eq(v, '\t'));
+		return _mm_or_si128(m, eq(v, '\r'));
+	}
+	static uint32_t specials(__m128i v) {
+		__m128i m = _mm_or_si128(blanks(v), eq(v, '\n'));
+		m = _mm_or_si128(m, eq(v, ','));
+		m = _mm_or_si128(m, _mm_or_si128(eq(v, ';'), eq(v, '"')));
+		m = _mm_or_si128(m, _mm_or_si128(eq(v, '\\'), eq(v, '+')));
+		m = _mm_or_si128(m, _mm_or_si128(eq(v, '-'), eq(v, '*')));
+		return _mm_movemask_epi8(m);
+	}
+
+	static size_t skip_blanks(const char* p, size_t i, size_t n, uint32_t& line)
+	{
+		for (; i + 16 <= n; i += 16) {
+			const __m128i v = _mm_loadu_si128((const __m128i *)&p[i]);
+			const __m128i nl = eq(v, '\n');
+			const uint32_t newlines = _mm_movemask_epi8(nl);
+			const uint32_t blank = _mm_movemask_epi8(_mm_or_si128(nl, blanks(v)));
+			if (blank != 0xFFFF) {
+				const unsigned pos = __builtin_ctz(~blank);
+				line += __builtin_popcount(newlines & ((1u << pos) - 1));
+				return i + pos;
+			}
+			line += __builtin_popcount(newlines);
+		}
+		for (; i < n && is_blank(p[i]); i++)
+			line += (p[i] == '\n');
+		return i;
+	}
+	static size_t find_special(const char* p, size_t i, size_t n)
+	{
+		for (; i + 16 <= n; i += 16) {
+			const __m128i v = _mm_loadu_si128((const __m128i *)&p[i]);
+			const uint32_t mask = specials(v);
+			if (mask != 0)
+				return i + __builtin_ctz(mask);
+		}
+		while (i < n && !is_special(p[i])) i++;
+		return i;
+	}
+	static size_t find_quote(const char* p, size_t i, size_t n, uint32_t& line)
+	{
+		for (; i + 16 <= n; i += 16) {
+			const __m128i v = _mm_loadu_si128((const __m128i *)&p[i]);
+			const uint32_t newlines = _mm_movemask_epi8(eq(v, '\n'));
+			const uint32_t mask = _mm_movemask_epi8(
+				_mm_or_si128(eq(v, '"'), eq(v, '\\')));
+			if (mask != 0) {
+				const unsigned pos = __builtin_ctz(mask);
+				line += __builtin_popcount(newlines & ((1u << pos) - 1));
+				return i + pos;
+			}
+			line += __builtin_popcount(newlines);
+		}
+		for (; i < n && p[i] != '"' && p[i] != '\\'; i++)
+			line += (p[i] == '\n');
+		return i;
+	}
+};
+
+struct AVX2Scanner {
+	AVX2_TARGET static __m256i eq(__m256i v, char c) {
+		return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c));
+	}
+	AVX2_TARGET static __m256i blanks(__m256i v) {
+		__m256i m = _mm256_or_si256(eq(v, ' '), eq(v, '\t'));
+		return _mm256_or_si256(m, eq(v, '\r'));
+	}
+	AVX2_TARGET static uint32_t specials(__m256i v) {
+		__m256i m = _mm256_or_si256(blanks(v), eq(v, '\n'));
+		m = _mm256_or_si256(m, eq(v, ','));
+		m = _mm256_or_si256(m, _mm256_or_si256(eq(v, ';'), eq(v, '"')));
+		m = _mm256_or_si256(m, _mm256_or_si256(eq(v, '\\'), eq(v, '+')));
+		m = _mm256_or_si256(m, _mm256_or_si256(eq(v, '-'), eq(v, '*')));
+		return _mm256_movemask_epi8(m);
+	}
+
+	AVX2_TARGET static size_t skip_blanks(const char* p, size_t i, size_t n, uint32_t& line)
+	{
+		for (; i + 32 <= n; i += 32) {
+			const __m256i v = _mm256_loadu_si256((const __m256i *)&p[i]);
+			const __m256i nl = eq(v, '\n');
+			const uint32_t newlines = _mm256_movemask_epi8(nl);
+			const uint32_t blank = _mm256_movemask_epi8(_mm256_or_si256(nl, blanks(v)));
+			if (blank != 0xFFFFFFFF) {
+				const unsigned pos = __builtin_ctz(~blank);
+				line += __builtin_popcount(newlines & ((1u << pos) - 1));
+				return i + pos;
+			}
+			line += __builtin_popcount(newlines);
+		}
+		return SSE2Scanner::skip_blanks(p, i, n, line);
+	}
+	AVX2_TARGET static size_t find_special(const char* p, size_t i, size_t n)
+	{
+		for (; i + 32 <= n; i += 32) {
+			const __m256i v = _mm256_loadu_si256((const __m256i *)&p[i]);
+			const uint32_t mask = specials(v);
+			if (mask != 0)
+				return i + __builtin_ctz(mask);
+		}
+		return SSE2Scanner::find_special(p, i, n);
+	}
+	AVX2_TARGET static size_t find_quote(const char* p, size_t i, size_t n, uint32_t& line)
+	{
+		for (; i + 32 <= n; i += 32) {
+			const __m256i v = _mm256_loadu_si256((const __m256i *)&p[i]);
+			const uint32_t newlines = _mm256_movemask_epi8(eq(v, '\n'));
+			const uint32_t mask = _mm256_movemask_epi8(
+				_mm256_or_si256(eq(v, '"'), eq(v, '\\')));
+			if (mask != 0) {
+				const unsigned pos = __builtin_ctz(mask);
+				line += __builtin_popcount(newlines & ((1u << pos) - 1));
+				return i + pos;
+			}
+			line += __builtin_popcount(newlines);
+		}
+		return SSE2Scanner::find_quote(p, i, n, line);
+	}
+};
+
+/* Skips whole runs of blanks, comments and word characters at a time.
+   Escaped characters are rare, so those are handed over to the scalar
+   lexer, which then runs until it's done with the current word. */
+template <class Scanner>
+static void split_vectorized(TokenStream& tokens, std::string_view s, StringArena& arena, uint32_t line)
+{
+	ScalarLexer lexer {tokens, arena, s, line};
+	auto& word = lexer.word;
+	const char* p = s.data();
+	const size_t n = s.size();
+
+	size_t i = 0;
+	while (true)
+	{
+		i = Scanner::skip_blanks(p, i, n, lexer.line);
+		if (i >= n) break;
+
+		const size_t begin = i;
+		const char c = p[i];
+		if (c == ';') {
+			/* The newline ending the comment is a blank. */
+			const void* nl = std::memchr(&p[i], '\n', n - i);
+			if (nl == nullptr) break;
+			i = (const char *)nl - p;
+			continue;
+		}
+		if (c == ',') {
+			tokens.mark_comma();
+			i++;
+			continue;
+		}
+		/* This allows building constant chains */
+		if (c == '+' || c == '-' || c == '*') i++;
+
+		i = Scanner::find_special(p, i, n);
+		word.begin  = begin;
+		word.length = i - begin;
+		if (i < n && p[i] == '"') {
+			i = Scanner::find_quote(p, i + 1, n, lexer.line);
+			if (i < n && p[i] == '"') {
+				i++;
+				word.length = i - begin;
+				word.flush(tokens, arena, lexer.line);
+				continue;
+			}
+			word.length = i - begin;
+			lexer.begin_quotes = true;
+			i = lexer.run(i, true);
+		} else if (i < n && p[i] == '\\') {
+			i = lexer.run(i, true);
+		} else {
+			word.flush(tokens, arena, lexer.line);
+		}
+	}
+	lexer.finish();
+}
+
+void split_sse2(TokenStream& tokens, std::string_view s, StringArena& arena, uint32_t line)
+{
+	split_vectorized<SSE2Scanner>(tokens, s, arena, line);
+}
+void split_avx2(TokenStream& tokens, std::string_view s, StringArena& arena, uint32_t line)
+{
+	split_vectorized<AVX2Scanner>(tokens, s, arena, line);
+}
+
+#endif
@@ -0,0 +1,146 @@
+#include "source.hpp"
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string& path)
+{
+	const int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("Could not open file: " + path);
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		this->m_size = st.st_size;
+		if (m_size == 0) {
+			close(fd);
+			return;
+		}
+		void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			madvise(data, m_size, MADV_SEQUENTIAL);
+			this->m_data = (const char *)data;
+			this->m_mapped = true;
+			close(fd);
+			return;
+		}
+	}
+	/* Not mappable, so read it all into a buffer instead. */
+	size_t size = 0;
+	while (true) {
+		m_buffer.resize(size + 65536);
+		const ssize_t n = read(fd, m_buffer.data() + size, m_buffer.size() - size);
+		if (n < 0) {
+			close(fd);
+			throw std::runtime_error("Error when reading from file: " + path);
+		}
+		if (n == 0) break;
+		size += n;
+	}
+	close(fd);
+	m_buffer.resize(size);
+	this->m_data = m_buffer.data();
+	this->m_size = size;
+}
+MappedFile::~MappedFile()
+{
+	if (m_mapped)
+		munmap((void *)m_data, m_size);
+}
+
+std::string_view StringArena::store(std::string_view str)
+{
+	if (str.size() > CHUNK_SIZE / 4) {
+		/* Large strings get a chunk of their own. */
+		auto& chunk = m_large.emplace_back(new char[str.size()]);
+		std::memcpy(chunk.get(), str.data(), str.size());
+		return {chunk.get(), str.size()};
+	}
+	if (str.size() > m_left) {
+		this->m_ptr = m_chunks.emplace_back(new char[CHUNK_SIZE]).get();
+		this->m_left = CHUNK_SIZE;
+	}
+	char* dst = m_ptr;
+	std::memcpy(dst, str.data(), str.size());
+	this->m_ptr  += str.size();
+	this->m_left -= str.size();
+	return {dst, str.size()};
+}
+
+static std::string canonical_path(const std::string& path)
+{
+	char* real = realpath(path.c_str(), nullptr);
+	if (real == nullptr)
+		throw std::runtime_error("Could not resolve path: " + path);
+	std::string result {real};
+	free(real);
+	return result;
+}
+
+std::string Sources::resolve(const std::string& filename, const char* dir) const
+{
+	if (filename[0] == '/')
+		return canonical_path(filename);
+	/* Like cpp and gas, a file next to the includer comes first */
+	if (dir != nullptr) {
+		const std::string path = std::string(dir) + "/" + filename;
+		if (access(path.c_str(), R_OK) == 0)
+			return canonical_path(path);
+	}
+	if (access(filename.c_str(), R_OK) == 0)
+		return canonical_path(filename);
+	for (const auto& incdir : m_include_dirs) {
+		const std::string path = incdir + "/" + filename;
+		if (access(path.c_str(), R_OK) == 0)
+			return canonical_path(path);
+	}
+	throw std::runtime_error("Could not find file: " + filename);
+}
+
+void Sources::add_include_directory(const std::string& dir)
+{
+	m_include_dirs.push_back(canonical_path(dir));
+}
+
+uint64_t Sources::size_of(const std::string& filename, const char* dir) const
+{
+	if (filename.empty())
+		throw std::runtime_error("Empty filename");
+	const std::string path = resolve(filename, dir);
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0)
+		throw std::runtime_error("Could not open file: " + path);
+	return st.st_size;
+}
+
+SourceFile& Sources::open(const std::string& filename, const char* dir)
+{
+	if (filename.empty())
+		throw std::runtime_error("Empty filename");
+	const std::string path = resolve(filename, dir);
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0)
+		throw std::runtime_error("Could not open file: " + path);
+	const int64_t mtime = st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+
+	std::lock_guard<std::mutex> lock(m_mtx);
+	auto& cached = m_cache[path];
+	if (cached != nullptr && cached->mtime == mtime && cached->size == (uint64_t)st.st_size)
+		return *cached;
+
+	/* Previous mappings and tokens stay alive, as they may
+	   still be referred to. */
+	const auto text = m_files.emplace_back(path).view();
+	auto& file = m_sources.emplace_back();
+	file.path = path;
+	file.directory = path.substr(0, path.rfind('/'));
+	if (file.directory.empty()) file.directory = "/";
+	file.text = text;
+	file.mtime = mtime;
+	file.size = st.st_size;
+	cached = &file;
+	return file;
+}
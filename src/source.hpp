@@ -0,0 +1,85 @@
+#pragma once
+#include "types.hpp"
+struct Assembler;
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/* A read-only memory mapping of a source file. Tokens are views
+   into the mapping, so it has to outlive the whole assembly.
+   Files that cannot be mapped (pipes, devices) are read instead. */
+struct MappedFile {
+	std::string_view view() const noexcept { return {m_data, m_size}; }
+	size_t size() const noexcept { return m_size; }
+
+	MappedFile(const std::string& path);
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator =(const MappedFile&) = delete;
+	~MappedFile();
+private:
+	const char* m_data = nullptr;
+	size_t m_size = 0;
+	bool m_mapped = false;
+	std::vector<char> m_buffer;
+};
+
+/* Bump allocator for strings that cannot be views into a source
+   file, such as string literals with escaped characters. */
+struct StringArena {
+	std::string_view store(std::string_view);
+private:
+	static constexpr size_t CHUNK_SIZE = 65536;
+	std::vector<std::unique_ptr<char[]>> m_chunks;
+	std::vector<std::unique_ptr<char[]>> m_large;
+	char*  m_ptr = nullptr;
+	size_t m_left = 0;
+};
+
+/* A source file, and its tokens once it has been lexed. A file is
+   lexed only once, no matter how many times or by how many of the
+   assemblers of the input files it is included. Symbols are interned
+   into the tokens by the assembler that lexed them, see assemble.cpp */
+struct SourceFile {
+	std::string path;      /* Canonical path */
+	std::string directory; /* Includes are relative to this */
+	std::string_view text;
+	TokenStream tokens;
+	StringArena arena;     /* Strings of the tokens that aren't views */
+	std::once_flag lexed;
+	const Assembler* owner = nullptr; /* Interned the tokens */
+	/* A file that changes is mapped and lexed again */
+	int64_t  mtime = 0;
+	uint64_t size = 0;
+};
+
+/* Owns every mapped source file, keeping all token views valid for
+   the lifetime of the assemblers. It is shared by the assemblers of
+   all input files, which may open files from any thread. */
+struct Sources {
+	/* Finds and maps filename, looking in the directory dir of the
+	   including file, then in the current directory and then in the
+	   include directories. Files are cached by their canonical path,
+	   and are not mapped again unless their modification time or size
+	   changes. */
+	SourceFile& open(const std::string& filename, const char* dir = nullptr);
+	std::string_view load(const std::string& filename, const char* dir = nullptr) {
+		return open(filename, dir).text;
+	}
+	/* The size of a file found like above, without reading it. */
+	uint64_t size_of(const std::string& filename, const char* dir = nullptr) const;
+	/* Add a directory to search for includes, from -I. */
+	void add_include_directory(const std::string&);
+
+private:
+	std::string resolve(const std::string& filename, const char* dir) const;
+
+	std::mutex m_mtx;
+	std::deque<MappedFile> m_files;
+	std::deque<SourceFile> m_sources;
+	std::unordered_map<std::string, SourceFile*> m_cache;
+	std::vector<std::string> m_include_dirs;
+};
@@ -0,0 +1,101 @@
+#include "stream.hpp"
+#include "assembler.hpp"
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+static constexpr size_t CHUNK_SIZE = 1u << 20;
+
+bool TokenQueue::push(std::unique_ptr<TokenBatch> batch)
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	m_cond.wait(lock, [this] { return m_count < m_ring.size() || m_closed; });
+	/* The consumer went away. */
+	if (m_closed) return false;
+	m_ring[(m_head + m_count) % m_ring.size()] = std::move(batch);
+	m_count++;
+	m_cond.notify_all();
+	return true;
+}
+std::unique_ptr<TokenBatch> TokenQueue::pop()
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	m_cond.wait(lock, [this] { return m_count > 0 || m_closed; });
+	if (m_count == 0) {
+		if (m_error) std::rethrow_exception(m_error);
+		return nullptr;
+	}
+	auto batch = std::move(m_ring[m_head]);
+	m_head = (m_head + 1) % m_ring.size();
+	m_count--;
+	m_cond.notify_all();
+	return batch;
+}
+void TokenQueue::close(std::exception_ptr error)
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	if (!m_closed) {
+		m_closed = true;
+		m_error = error;
+	}
+	m_cond.notify_all();
+}
+
+StreamReader::StreamReader(int fd, TokenQueue& queue, Conditionals& conditionals)
+	: m_fd{fd}, m_queue{queue}, m_conditionals{conditionals},
+	  m_thread{&StreamReader::run, this}
+{
+}
+StreamReader::~StreamReader()
+{
+	/* Unblocks the reader if the assembler stopped early. */
+	m_queue.close();
+	m_thread.join();
+}
+
+void StreamReader::run()
+{
+	try {
+		std::vector<char> carry;
+		uint32_t line = 1;
+		bool eof = false;
+		while (!eof || !carry.empty())
+		{
+			auto batch = std::make_unique<TokenBatch>();
+			auto& text = batch->text;
+			text = std::move(carry);
+			carry.clear();
+			/* Read at least a chunk, and keep reading until there is
+			   a line boundary to cut at. */
+			size_t cut = 0;
+			while (true) {
+				if (text.size() >= CHUNK_SIZE || eof) {
+					auto* nl = (const char *)memrchr(text.data(), '\n', text.size());
+					cut = (nl != nullptr) ? nl - text.data() + 1 : 0;
+					if (cut > 0 || eof) break;
+				}
+				const size_t size = text.size();
+				text.resize(size + CHUNK_SIZE);
+				const ssize_t n = read(m_fd, text.data() + size, CHUNK_SIZE);
+				if (n < 0)
+					throw std::runtime_error("Error when reading from stream");
+				text.resize(size + n);
+				eof = (n == 0);
+			}
+			if (!eof) {
+				carry.assign(text.begin() + cut, text.end());
+				text.resize(cut);
+			}
+
+			const std::string_view view {text.data(), text.size()};
+			batch->tokens = m_conditionals.split(view, batch->arena, line);
+			line += std::count(text.begin(), text.end(), '\n');
+			if (!batch->tokens.empty()) {
+				if (!m_queue.push(std::move(batch))) return;
+			}
+		}
+		m_conditionals.finish();
+		m_queue.close();
+	} catch (...) {
+		m_queue.close(std::current_exception());
+	}
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include "conditional.hpp"
+#include "source.hpp"
+#include "types.hpp"
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+/* A piece of a streamed source, cut at a line boundary, along with
+   its tokens. The tokens are views into the batch's own text. */
+struct TokenBatch {
+	std::vector<char> text;
+	StringArena arena;
+	TokenStream tokens;
+};
+
+/* Bounded single-producer single-consumer ring of token batches. */
+struct TokenQueue {
+	/* Blocks while the ring is full. Returns false when closed. */
+	bool push(std::unique_ptr<TokenBatch>);
+	/* Blocks until a batch is ready. Returns nullptr at the end. */
+	std::unique_ptr<TokenBatch> pop();
+	void close(std::exception_ptr = nullptr);
+
+	TokenQueue(size_t capacity) : m_ring(capacity) {}
+private:
+	std::vector<std::unique_ptr<TokenBatch>> m_ring;
+	size_t m_head = 0;
+	size_t m_count = 0;
+	bool m_closed = false;
+	std::exception_ptr m_error = nullptr;
+	std::mutex m_mtx;
+	std::condition_variable m_cond;
+};
+
+/* Reads and lexes a file descriptor on a thread of its own, so
+   that I/O and lexing overlap with assembling. */
+struct StreamReader {
+	StreamReader(int fd, TokenQueue& queue, Conditionals& conditionals);
+	~StreamReader();
+private:
+	void run();
+
+	const int m_fd;
+	TokenQueue& m_queue;
+	Conditionals& m_conditionals;
+	std::thread m_thread;
+};
@@ -0,0 +1,67 @@
+#include "symbols.hpp"
+#include <functional>
+
+static inline uint32_t hash_name(std::string_view name) {
+	return std::hash<std::string_view>{}(name);
+}
+
+/* Returns the slot of name, or the empty slot where it would go. */
+size_t SymbolTable::probe(std::string_view name, uint32_t hash) const noexcept
+{
+	const size_t mask = m_slots.size() - 1;
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		const auto& slot = m_slots[i];
+		if (slot.id == NONE) return i;
+		if (slot.hash == hash && m_names[slot.id] == name) return i;
+	}
+}
+void SymbolTable::grow()
+{
+	std::vector<Slot> slots(m_slots.empty() ? 1024 : m_slots.size() * 2);
+	const size_t mask = slots.size() - 1;
+	for (const auto& slot : m_slots) {
+		if (slot.id == NONE) continue;
+		size_t i = slot.hash & mask;
+		while (slots[i].id != NONE) i = (i + 1) & mask;
+		slots[i] = slot;
+	}
+	m_slots = std::move(slots);
+}
+
+symbol_id SymbolTable::intern(std::string_view name)
+{
+	/* Keep the load factor at or below one half. */
+	if (2 * (m_names.size() + 1) > m_slots.size())
+		this->grow();
+	const uint32_t hash = hash_name(name);
+	auto& slot = m_slots[probe(name, hash)];
+	if (slot.id != NONE) return slot.id;
+
+	const symbol_id id = m_names.size();
+	m_names.push_back(m_arena.store(name));
+	m_locations.push_back(SymbolLocation{nullptr, 0});
+	m_flags.push_back(0);
+	slot = Slot{hash, id};
+	return id;
+}
+symbol_id SymbolTable::add_local(std::string_view name)
+{
+	const symbol_id id = m_names.size();
+	m_names.push_back(m_arena.store(name));
+	m_locations.push_back(SymbolLocation{nullptr, 0});
+	m_flags.push_back(LOCAL);
+	return id;
+}
+symbol_id SymbolTable::find(std::string_view name) const
+{
+	if (m_slots.empty()) return NONE;
+	return m_slots[probe(name, hash_name(name))].id;
+}
+
+bool SymbolTable::define(symbol_id id, SymbolLocation loc)
+{
+	if (is_defined(id)) return false;
+	m_locations[id] = loc;
+	m_flags[id] |= DEFINED;
+	return true;
+}
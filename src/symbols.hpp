@@ -0,0 +1,50 @@
+#pragma once
+#include "section.hpp"
+#include "source.hpp"
+
+/* Symbol names are interned once, as their tokens are read, into dense
+   IDs. Everything known about a symbol is kept in vectors indexed by
+   its ID, so passes over all symbols are linear and hash-free. */
+struct SymbolTable {
+	static constexpr symbol_id NONE = UINT32_MAX;
+
+	symbol_id intern(std::string_view name);
+	/* A new local label, which is never found by name. */
+	symbol_id add_local(std::string_view name);
+	/* Returns NONE for names that were never seen. */
+	symbol_id find(std::string_view name) const;
+	size_t size() const noexcept { return m_names.size(); }
+	std::string_view name(symbol_id id) const noexcept { return m_names[id]; }
+
+	bool is_defined(symbol_id id) const noexcept { return m_flags[id] & DEFINED; }
+	bool is_global(symbol_id id) const noexcept { return m_flags[id] & GLOBAL; }
+	bool is_local(symbol_id id) const noexcept { return m_flags[id] & LOCAL; }
+	/* The first definition of a symbol is the one that counts, and
+	   false is returned for any other. */
+	bool define(symbol_id, SymbolLocation);
+	void make_global(symbol_id id) noexcept { m_flags[id] |= GLOBAL; }
+
+	SymbolLocation& location(symbol_id id) noexcept { return m_locations[id]; }
+	const SymbolLocation& location(symbol_id id) const noexcept { return m_locations[id]; }
+
+private:
+	enum : uint8_t {
+		DEFINED = 0x1,
+		GLOBAL  = 0x2,
+		LOCAL   = 0x4,
+	};
+	std::vector<std::string_view> m_names;
+	std::vector<SymbolLocation> m_locations;
+	std::vector<uint8_t> m_flags;
+	/* Open addressing with linear probing, where each slot holds
+	   a hash and an ID, so that probing stays within a cache line. */
+	struct Slot {
+		uint32_t  hash;
+		symbol_id id = NONE;
+	};
+	size_t probe(std::string_view name, uint32_t hash) const noexcept;
+	void grow();
+	std::vector<Slot> m_slots;
+	/* Names outlive the streamed batches they came from. */
+	StringArena m_arena;
+};
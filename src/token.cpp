@@ -1,22 +1,18 @@
 #include "types.hpp"
-#include <cstring>
+#include "keywords.hpp"
 
-Token::Token(const Token& other)
-	: type(other.type), line(other.line), value(other.value)
+const Opcode* Token::opcode() const noexcept
 {
-	switch (type) {
-	case TK_OPCODE:
-		opcode = other.opcode; break;
-	case TK_PSEUDOOP:
-		pseudoop = other.pseudoop; break;
-	default:
-		std::memcpy(raw, other.raw, sizeof(raw));
-	}
+	return Keywords::get(stream->m_payload[index]).opcode;
+}
+const PseudoOp* Token::pseudoop() const noexcept
+{
+	return Keywords::get(stream->m_payload[index]).pseudoop;
 }
 
 std::string Token::to_string() const
 {
-	return to_string(this->type) + " " + value;
+	return to_string(this->type()) + " " + std::string(value());
 }
 
 std::string Token::to_string(TokenType tt)
@@ -36,6 +32,8 @@ std::string Token::to_string(TokenType tt)
 		return "[Symbol]";
 	case TK_CONSTANT:
 		return "[Constant]";
+	case TK_OPERATOR:
+		return "[Operator]";
 	default:
 		return "Unknown token: " + std::to_string(tt);
 	}
@@ -1,76 +1,105 @@
 #include "assembler.hpp"
-#include "opcodes.hpp"
-#include "registers.hpp"
+#include "keywords.hpp"
+#include "literal.hpp"
 #include <cassert>
 #include <stdexcept>
-extern Token pseudo_op(const std::string&);
 
-static bool is_operator(const std::string& word) {
-	return word == "+" || word == "-" || word == "*" || word == "/"
-		|| word == "<<" || word == ">>" || word == "%"
-		|| word == "|" || word == "&" || word == "^"
-		|| word == "~";
+static bool is_operator(char c) {
+	switch (c) {
+	case '(': case ')': case '~': case '!': case '*': case '/': case '%':
+	case '+': case '-': case '<': case '>': case '=': case '&': case '|':
+	case '^':
+		return true;
+	default:
+		return false;
+	}
+}
+/* Operators of two characters: << >> <= >= == != && || */
+static bool is_operator_pair(char a, char b) {
+	if (b == '=') return a == '<' || a == '>' || a == '=' || a == '!';
+	return a == b && (a == '<' || a == '>' || a == '&' || a == '|');
 }
 static bool is_number(char c) {
 	return (c == '-' || c == '+' || (c >= '0' && c <= '9'));
 }
+/* 1b and 1f refer to the numeric label 1: before and after */
+static bool is_numeric_reference(std::string_view word) {
+	if (word.size() < 2 || (word.back() != 'b' && word.back() != 'f'))
+		return false;
+	for (size_t i = 0; i < word.size() - 1; i++)
+		if (word[i] < '0' || word[i] > '9') return false;
+	return true;
+}
 
-Token Assembler::parse(const RawToken& rt)
+static void parse_word(TokenStream& tokens, std::string_view word, uint32_t line)
 {
-	const auto& word = rt.name;
-	assert(!word.empty());
-	Token tk(TK_SYMBOL);
-	if (word[0] == '.') {
-		tk.type = TK_DIRECTIVE;
-		tk.value = word;
-	} else if (word.back() == ':') {
-		tk.type = TK_LABEL;
-		tk.value = word.substr(0, word.size() - 1);
+	TokenType type = TK_SYMBOL;
+	uint32_t payload = 0;
+	if (word.back() == ':') {
+		type = TK_LABEL;
+		word = word.substr(0, word.size() - 1);
+	} else if (word.size() > 2 && word[0] == '.' && word[1] == 'L') {
+		type = TK_SYMBOL; /* Local label */
+	} else if (word[0] == '.') {
+		type = TK_DIRECTIVE;
+	} else if (is_numeric_reference(word)) {
+		type = TK_SYMBOL;
 	} else if (word[0] == '"') {
-		tk.type = TK_STRING;
-		tk.value = word.substr(1, word.size() - 2);
+		type = TK_STRING;
+		word = word.substr(1, word.size() - 2);
 	} else if (word[0] == '\'') {
 		if (word.size() > 2 && word[2] == '\'') {
-			tk.type = TK_CONSTANT;
-			tk.u64 = word[1];
+			type = TK_CONSTANT;
+			payload = tokens.add_constant(word[1]);
 		} else throw std::runtime_error(
-			"Invalid character constant: " + word + ". Missing quote?");
-	} else if (is_operator(word)) {
-		tk.type = TK_OPERATOR;
-		tk.value = word;
+			"Invalid character constant: " + std::string(word) + ". Missing quote?");
 	} else if (is_number(word[0])) {
-		if (word.size() > 2 && word[1] == 'x') {
-			if (word.size() > 18) {
-				/* 128-bit constant */
-				const size_t upsize = word.size()-18;
-				std::string lower = word.substr(word.size()-16);
-				std::string upper = word.substr(2, upsize);
-				tk.u128 = std::stoull(upper.c_str(), nullptr, 16);
-				tk.u128 <<= 64;
-				tk.u128 |= std::stoull(lower.c_str(), nullptr, 16);
-			} else {
-				/* 8-64-bit constant */
-				tk.u64 = std::stoull(&word[2], nullptr, 16);
-			}
-		} else if (word.size() > 2 && word[1] == 'b') {
-			tk.u64 = std::stoull(&word[2], nullptr, 2);
-		} else { // base 10
-			tk.i64 = atoi(word.c_str());
-		}
-		tk.type = TK_CONSTANT;
-		tk.value = word;
+		const char* end = word.data() + word.size();
+		__uint128_t value = 0;
+		const auto res = parse_literal(word.data(), end, value);
+		if (res.ec == std::errc::result_out_of_range)
+			throw std::runtime_error(
+				"Constant does not fit in 128 bits: " + std::string(word));
+		else if (res.ec != std::errc() || res.ptr != end)
+			throw std::runtime_error(
+				"Invalid constant: " + std::string(word));
+		type = TK_CONSTANT;
+		payload = tokens.add_constant(value);
 	} else {
-		tk = Opcodes::opcode(word);
-		// Try again with register
-		if (tk.is_symbol()) {
-			tk = Registers::to_reg(word);
-			// Try again with pseudo-op
-			if (tk.is_symbol())
-				tk = pseudo_op(word);
+		/* Opcodes, registers and pseudo-ops in one probe. */
+		if (const auto* kw = Keywords::lookup(word)) {
+			type = kw->type;
+			payload = (type == TK_REGISTER) ? kw->reg : kw->index;
 		}
 	}
-	/* Fixup line here, because opcodes and pseudo-ops lack
-	   line number information. */
-	tk.line = rt.line;
-	return tk;
+	tokens.push_back(type, line, word, payload);
+}
+
+/* Operators are split off the words around them, so that expressions
+   need no spaces: (end-_start)*2 and -end both work. A sign followed
+   by a digit is part of the constant instead, so -1 is a constant. */
+void Assembler::parse(TokenStream& tokens, const RawToken& rt)
+{
+	const std::string_view word = rt.name;
+	assert(!word.empty());
+	if (word[0] == '"' || word[0] == '\'' || word.back() == ':') {
+		parse_word(tokens, word, rt.line);
+		return;
+	}
+	size_t begin = 0;
+	for (size_t i = 0; i < word.size(); i++) {
+		const char c = word[i];
+		if (!is_operator(c)) continue;
+		if ((c == '-' || c == '+') && i == begin
+			&& i + 1 < word.size() && word[i + 1] >= '0' && word[i + 1] <= '9')
+			continue;
+		if (i > begin)
+			parse_word(tokens, word.substr(begin, i - begin), rt.line);
+		const size_t len = (i + 1 < word.size() && is_operator_pair(c, word[i + 1])) ? 2 : 1;
+		tokens.push_back(TK_OPERATOR, rt.line, word.substr(i, len), 0);
+		i += len - 1;
+		begin = i + 1;
+	}
+	if (begin < word.size())
+		parse_word(tokens, word.substr(begin), rt.line);
 }
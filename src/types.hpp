@@ -1,13 +1,15 @@
 #pragma once
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 
 using address_t = __uint128_t;
+using symbol_id = uint32_t;
 extern std::string to_hex_string(address_t);
 
 struct RawToken {
-	std::string name;
+	std::string_view name;
 	uint32_t line;
 };
 
@@ -32,33 +34,160 @@ struct Opcode;
 
 struct PseudoOp;
 
+struct TokenStream;
+
+/* A handle to a token in a token stream. Handles are cheap to copy,
+   and stay valid for as long as the stream does. */
 struct Token {
-	enum TokenType type;
-	uint32_t line = 0;
-	std::string value;
-	union {
-		address_t addr;
-		int64_t   i64;
-		uint64_t  u64;
-		__uint128_t  u128;
-		const Opcode* opcode;
-		const PseudoOp* pseudoop;
-		char      raw[16];
-	};
+	const TokenStream* stream;
+	uint32_t index;
+
+	inline TokenType type() const noexcept;
+	inline uint32_t line() const noexcept;
+	/* View into a mapped source file or the string arena. */
+	inline std::string_view value() const noexcept;
+	/* Register number, for registers. */
+	inline uint8_t reg() const noexcept;
+	/* Interned ID, for symbols and labels. */
+	inline symbol_id symbol() const noexcept;
+	/* The value of constants. */
+	inline __uint128_t u128() const noexcept;
+	int64_t  i64() const noexcept { return u128(); }
+	uint64_t u64() const noexcept { return u128(); }
+	const Opcode* opcode() const noexcept;
+	const PseudoOp* pseudoop() const noexcept;
 
-	bool is_opcode() const noexcept { return type == TK_OPCODE; }
-	bool is_register() const noexcept { return type == TK_REGISTER; }
-	bool is_symbol() const noexcept { return type == TK_SYMBOL; }
+	bool is_opcode() const noexcept { return type() == TK_OPCODE; }
+	bool is_register() const noexcept { return type() == TK_REGISTER; }
+	bool is_symbol() const noexcept { return type() == TK_SYMBOL; }
+	/* A comma follows, which ends a list item or macro argument. */
+	inline bool comma() const noexcept;
 
 	std::string to_string() const;
 	static std::string to_string(TokenType);
+};
+
+/* Tokens stored as parallel arrays, so that each token takes up only
+   the space it needs. The payload is the register number, the index
+   of the keyword for opcodes and pseudo-ops, the index of the value
+   for constants, or the symbol ID once symbols have been interned.
+   The top bit of the type is set when a comma follows the token. */
+struct TokenStream {
+	static constexpr uint8_t COMMA = 0x80;
 
-	Token(TokenType tt = TK_UNSPEC, uint32_t ln = 0)
-		: type(tt), line(ln), addr(0) {}
-	Token(const Token&);
-	Token& operator =(const Token& other) {
-		new(this) Token(other); return *this;
+	size_t size() const noexcept { return m_types.size(); }
+	bool empty() const noexcept { return m_types.empty(); }
+	/* Remove every token, keeping the memory for reuse */
+	void clear() noexcept {
+		m_types.clear(); m_lines.clear(); m_payload.clear();
+		m_begin.clear(); m_length.clear(); m_constants.clear();
+	}
+	Token operator[] (size_t i) const noexcept { return Token{this, (uint32_t)i}; }
+
+	void push_back(TokenType tt, uint32_t line, std::string_view value, uint32_t payload) {
+		m_types.push_back(tt);
+		m_lines.push_back(line);
+		m_payload.push_back(payload);
+		m_begin.push_back(value.data());
+		m_length.push_back(value.size());
+	}
+	/* The last token is followed by a comma */
+	void mark_comma() {
+		if (!m_types.empty()) m_types.back() |= COMMA;
+	}
+	uint32_t add_constant(__uint128_t value) {
+		m_constants.push_back(value);
+		return m_constants.size() - 1;
+	}
+	/* Copy a token from another stream, with value as its text. */
+	void append(const Token& tk, std::string_view value) {
+		const auto& src = *tk.stream;
+		const uint32_t payload = (tk.type() == TK_CONSTANT)
+			? add_constant(tk.u128()) : src.m_payload[tk.index];
+		push_back(tk.type(), tk.line(), value, payload);
+		if (tk.comma()) mark_comma();
+	}
+	/* Copy a token from another stream onto the given line, with a
+	   comma after it or not. */
+	void splice(const Token& tk, uint32_t line, bool comma) {
+		const auto& src = *tk.stream;
+		const uint32_t payload = (tk.type() == TK_CONSTANT)
+			? add_constant(tk.u128()) : src.m_payload[tk.index];
+		push_back(tk.type(), line, tk.value(), payload);
+		if (comma) mark_comma();
+	}
+	/* Overwrite token i with a token from another stream, keeping the
+	   line of token i, and whether a comma follows it. Constants are
+	   stored in the given slot. */
+	void replace(size_t i, const Token& tk, uint32_t slot) {
+		const auto& src = *tk.stream;
+		m_types[i] = tk.type() | (m_types[i] & COMMA);
+		if (tk.type() == TK_CONSTANT) {
+			m_constants[slot] = tk.u128();
+			m_payload[i] = slot;
+		} else {
+			m_payload[i] = src.m_payload[tk.index];
+		}
+		m_begin[i]  = src.m_begin[tk.index];
+		m_length[i] = src.m_length[tk.index];
+	}
+	/* Turn token i into the constant in slot. */
+	void make_constant(size_t i, uint32_t slot) {
+		m_types[i] = TK_CONSTANT | (m_types[i] & COMMA);
+		m_payload[i] = slot;
 	}
+	void set_constant(uint32_t slot, __uint128_t value) {
+		m_constants[slot] = value;
+	}
+	void set_symbol(size_t i, symbol_id id) {
+		m_payload[i] = id;
+	}
+private:
+	std::vector<uint8_t>  m_types;
+	std::vector<uint32_t> m_lines;
+	std::vector<uint32_t> m_payload;
+	std::vector<const char*> m_begin;
+	std::vector<uint32_t> m_length;
+	std::vector<__uint128_t> m_constants;
+	friend struct Token;
+};
+static_assert(sizeof(Token) <= 16, "Tokens are meant to be small handles");
+
+inline TokenType Token::type() const noexcept {
+	return (TokenType)(stream->m_types[index] & ~TokenStream::COMMA);
+}
+inline bool Token::comma() const noexcept {
+	return stream->m_types[index] & TokenStream::COMMA;
+}
+inline uint32_t Token::line() const noexcept {
+	return stream->m_lines[index];
+}
+inline std::string_view Token::value() const noexcept {
+	return {stream->m_begin[index], stream->m_length[index]};
+}
+inline uint8_t Token::reg() const noexcept {
+	return stream->m_payload[index];
+}
+inline symbol_id Token::symbol() const noexcept {
+	return stream->m_payload[index];
+}
+inline __uint128_t Token::u128() const noexcept {
+	return stream->m_constants[stream->m_payload[index]];
+}
+
+/* The value of a constant expression, and the token it started at. */
+struct Constant {
+	union {
+		address_t addr;
+		int64_t   i64;
+		uint64_t  u64;
+		__uint128_t u128;
+	};
+	Token token;
+	/* Refers to symbols, and is completed by a relocation */
+	bool deferred = false;
+	/* Is only a symbol, and the relocation is not an expression */
+	bool symbol = false;
 };
 
 struct Assembler;
@@ -0,0 +1,198 @@
+#include "opcodes.hpp"
+#include "instruction_list.hpp"
+#include <cstdio>
+#include <random>
+#include <set>
+#include <string>
+
+/* Builds constants for set from a corpus of edge cases and random
+   values, and runs each sequence on a small interpreter. Every value
+   must come out right, and never with more instructions than the
+   sequence that set had before, which is kept here to compare with.
+   The instruction counts of both are printed. */
+
+using u128 = unsigned __int128;
+static constexpr unsigned REG_T0 = 5;
+static constexpr unsigned REG_A0 = 10;
+
+/* The LUI + ADDI, or ADDI, that set had for 32 bits */
+static void old_uint32(InstructionList& res, int reg, int32_t value)
+{
+	Instruction i1(RV32I_OP_IMM);
+	i1.Itype.rd = reg;
+	i1.Itype.imm = value;
+	Instruction i2(RV32I_LUI);
+	i2.Utype.rd = reg;
+	i2.Utype.imm = (value + i1.Itype.imm) >> 12;
+	if (i2.Utype.imm) {
+		i1.Itype.rs1 = reg;
+		res.push_back(i2);
+		if (value & 0xFFF)
+			res.push_back(i1);
+	} else {
+		res.push_back(i1);
+	}
+}
+
+/* The four 32-bit chunks, shifted and added, that set had before */
+static void old_set(InstructionList& res, unsigned rd, unsigned tmp, u128 constant)
+{
+	if (constant < 0x100000000) {
+		old_uint32(res, rd, (int64_t)constant);
+		return;
+	}
+	union {
+		__int128_t whole;
+		int32_t    imm[4];
+	} value;
+	value.whole = constant;
+	old_uint32(res, rd, value.imm[3]);
+	u128 value_so_far = value.imm[3];
+	for (int i = 2; i >= 0; i--) {
+		const auto imm = value.imm[i];
+		old_uint32(res, tmp, imm);
+		if (value_so_far != 0) {
+			Instruction i3(RV32I_OP_IMM);
+			i3.Itype.rd  = rd;
+			i3.Itype.rs1 = rd;
+			i3.Itype.funct3 = 0x1;
+			i3.Itype.imm = 32;
+			res.push_back(i3);
+		}
+		value_so_far <<= 32;
+		value_so_far |= imm;
+		Instruction i4(RV32I_OP);
+		i4.Rtype.rd  = rd;
+		i4.Rtype.rs1 = rd;
+		i4.Rtype.rs2 = tmp;
+		res.push_back(i4);
+	}
+}
+
+static u128 sext(u128 value, unsigned bits)
+{
+	const unsigned shift = 128 - bits;
+	return (u128)((__int128)(value << shift) >> shift);
+}
+
+/* Runs the instructions that constants are built from, and returns
+   what ends up in rd. Returns false on any other instruction. */
+static bool run(const InstructionList& il, unsigned rd, u128& result)
+{
+	u128 regs[32] {};
+	for (const auto& instr : il) {
+		const uint32_t w = instr.whole;
+		const unsigned opcode = w & 0x7F, dst = (w >> 7) & 31, funct3 = (w >> 12) & 7;
+		const u128 a = regs[(w >> 15) & 31], b = regs[(w >> 20) & 31];
+		const u128 imm = sext(w >> 20, 12);
+		const unsigned shamt = (w >> 20) & 127;
+		u128 value;
+		if (opcode == RV32I_LUI)
+			value = sext(w & 0xFFFFF000, 32);
+		else if (opcode == RV32I_OP_IMM && funct3 == 0)
+			value = a + imm;
+		else if (opcode == RV32I_OP_IMM && funct3 == 1)
+			value = a << shamt;
+		else if (opcode == RV32I_OP_IMM && funct3 == 4)
+			value = a ^ imm;
+		else if (opcode == RV32I_OP_IMM && funct3 == 5 && !(w & (1u << 30)))
+			value = a >> shamt;
+		else if (opcode == RV64I_OP_IMM32 && funct3 == 0)
+			value = sext(a + imm, 32);
+		else if (opcode == RV128I_OP_IMM64 && funct3 == 0)
+			value = sext(a + imm, 64);
+		else if (opcode == RV128I_OP_IMM64 && funct3 == 1)
+			value = sext(a << (shamt & 63), 64);
+		else if (opcode == RV32I_OP && funct3 == 0 && (w >> 25) == 0)
+			value = a + b;
+		else
+			return false;
+		if (dst != 0) regs[dst] = value;
+	}
+	result = regs[rd];
+	return true;
+}
+
+static std::set<u128> corpus()
+{
+	std::mt19937_64 rng(25);
+	auto bits = [&rng] (unsigned n) -> u128 {
+		const u128 value = ((u128)rng() << 64) | rng();
+		return (n >= 128) ? value : value & (((u128)1 << n) - 1);
+	};
+	auto below = [&rng] (unsigned n) { return (unsigned)(rng() % n); };
+	const u128 one = 1;
+	std::set<u128> values {
+		0, 1, (u128)-1, 2047, (u128)-2048, 2048, 0x7FFFF800, 0x7FFFFFFF,
+		0x80000000, 0xFFFFFFFF, 0x100000000, (one << 63) - 1, one << 63,
+		(one << 64) - 1, one << 64, (one << 127) - 1, one << 127, (u128)-256,
+		-(one << 32), -(one << 64), 0x1234567812345678,
+		((u128)0x1234567812345678 << 64) | 0x1234567812345678,
+		((u128)0xAAAA111122223333 << 64) | 0x4444555566667770,
+		0x0123456789ABCDEF, 0xFFFFFFFFFFFFFF00, 0x00FFFFFFFFFFFFFF,
+		(u128)0xDEADBEEF << 96, (u128)0x8000 << 80,
+	};
+	static constexpr unsigned widths[] {12, 20, 32, 33, 40, 48, 63, 64, 65, 80, 96, 100, 127, 128};
+	for (unsigned i = 0; i < 400; i++) {
+		const u128 v = bits(widths[below(std::size(widths))]);
+		values.insert(v);
+		values.insert(-v);
+		/* Few bits, anywhere */
+		values.insert(bits(12) << below(116));
+		values.insert((bits(20) << (12 + below(88))) + bits(12));
+		/* Repeated */
+		const unsigned period = 16 << below(3);
+		const u128 x = bits(period);
+		u128 repeated = 0;
+		for (unsigned s = 0; s < 128; s += period)
+			repeated |= x << s;
+		values.insert(repeated);
+		/* Runs of ones */
+		values.insert((one << (1 + below(127))) - 1);
+		values.insert(~((one << (1 + below(127))) - 1));
+	}
+	return values;
+}
+
+static std::string hex(u128 value)
+{
+	char buffer[40];
+	snprintf(buffer, sizeof(buffer), "0x%016llX%016llX",
+		(unsigned long long)(value >> 64), (unsigned long long)value);
+	return buffer;
+}
+
+int main()
+{
+	unsigned failures = 0;
+	size_t old_total = 0, old_wrong = 0, new_total = 0, single_total = 0;
+	auto fail = [&failures] (const char* what, u128 value, size_t count) {
+		if (failures++ < 10)
+			fprintf(stderr, "%s: %s (%zu instructions)\n", what, hex(value).c_str(), count);
+	};
+	const auto values = corpus();
+	for (const u128 value : values) {
+		InstructionList before, after, single;
+		old_set(before, REG_A0, REG_T0, value);
+		build_constant(after, REG_A0, REG_T0, value);
+		build_constant(single, REG_A0, REG_A0, value);
+		old_total += before.size();
+		new_total += after.size();
+		single_total += single.size();
+
+		u128 result;
+		const bool old_right = run(before, REG_A0, result) && result == value;
+		old_wrong += !old_right;
+		if (!run(after, REG_A0, result) || result != value)
+			fail("Wrong value", value, after.size());
+		else if (old_right && after.size() > before.size())
+			fail("Longer than before", value, after.size());
+		if (!run(single, REG_A0, result) || result != value)
+			fail("Wrong value without a temporary", value, single.size());
+	}
+	printf("%zu constants\n", values.size());
+	printf("Before: %zu instructions, %zu values wrong\n", old_total, old_wrong);
+	printf("Now:    %zu instructions, %zu without a temporary\n", new_total, single_total);
+	printf("%u problems\n", failures);
+	return failures != 0;
+}
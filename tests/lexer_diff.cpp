@@ -0,0 +1,204 @@
+#include "assembler.hpp"
+#include "lexer.hpp"
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+/* Lexes random inputs with the scalar lexer and the vectorized ones,
+   which must produce the same token streams, or fail the same way.
+   Inputs are built from pieces that are heavy in what the vectorized
+   lexers hand over to the scalar one: quotes, escapes and comments.
+   Given the source directory, it also lexes the programs/ corpus and
+   compares it with tests/lexer_baseline.txt, the output of the
+   tokenizer as of commit 9d9e3ce. */
+
+static const char* const common[] = {
+	" ", "  ", "\t", "\n", "\r\n", ",", ", ",
+	"addi", "a0", "t0", "sp", "label:", "my_label", ".L1", "1f", "1b",
+	".section", ".text", ".data", "dw", "set", "li", "lq", "sq",
+	"0x10", "0xAAAA1111222233334444555566667770", "1234", "-16", "0b101",
+	"+", "-", "*", "sp+0", "a0-1", "'a'", "(end", "_start)", "-end", "~0",
+	"(1<<4)|3", "a==b", "x!=-1", "a&&b||!c",
+	"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", /* Longer than a vector */
+};
+static const char* const quoted[] = {
+	"\"", "\"hello, world\"", "\"a;b\"", "\"\\n\"", "\"\\\"\"", "\"\\\\\"",
+	"\"\n\"", "\"                                        \"",
+};
+static const char* const escaped[] = {
+	"\\n", "\\t", "\\r", "\\b", "\\\\", "\\'", "\\\"", "\\0", "x\\ny",
+};
+static const char* const commented[] = {
+	";", ";;", "; comment\n", ";; a \"quoted\" comment\n",
+	";\\n\n", ";                                        \n",
+};
+
+template <size_t N>
+static const char* pick(std::mt19937& rng, const char* const (&pieces)[N])
+{
+	return pieces[rng() % N];
+}
+
+static std::string random_input(std::mt19937& rng, unsigned alphabet)
+{
+	std::string s;
+	const unsigned pieces = rng() % 64;
+	for (unsigned i = 0; i < pieces; i++) {
+		const unsigned r = rng() % 8;
+		if (r == 0 && alphabet != 2) s += pick(rng, quoted);
+		else if (r == 1 && alphabet != 1) s += pick(rng, escaped);
+		else if (r == 2 && alphabet != 0) s += pick(rng, commented);
+		else s += pick(rng, common);
+	}
+	return s;
+}
+
+using split_func_t = void (*)(TokenStream&, std::string_view, StringArena&, uint32_t);
+
+/* The tokens, or the problem the lexer ran into, one per line */
+static std::string lex(split_func_t split, const std::string& input)
+{
+	TokenStream tokens;
+	StringArena arena;
+	std::string result;
+	try {
+		split(tokens, input, arena, 1);
+	} catch (const std::exception& e) {
+		return std::string("Exception: ") + e.what() + "\n";
+	}
+	for (size_t i = 0; i < tokens.size(); i++) {
+		const Token tk = tokens[i];
+		result += std::to_string(tk.line()) + " " + tk.to_string();
+		if (tk.comma()) result += " ,";
+		if (tk.type() == TK_CONSTANT) {
+			result += " = " + std::to_string((uint64_t)(tk.u128() >> 64))
+				+ ":" + std::to_string((uint64_t)tk.u128());
+		}
+		result += "\n";
+	}
+	return result;
+}
+
+static const char* const type_names[] = {"Directive", "Label", "String", "Symbol",
+	"Opcode", "PseudoOp", "Register", "Constant", "Operator"};
+
+static std::string load(const std::string& path)
+{
+	std::ifstream file(path);
+	if (!file) throw std::runtime_error("Could not read " + path);
+	std::stringstream ss;
+	ss << file.rdbuf();
+	return ss.str();
+}
+
+/* A program as the baseline dump lists it: line, type, text, value */
+static std::string dump(const std::string& input)
+{
+	StringArena arena;
+	const TokenStream tokens = Assembler::split(input, arena);
+	std::string result;
+	for (size_t i = 0; i < tokens.size(); i++) {
+		const Token tk = tokens[i];
+		char value[48] = "";
+		if (tk.type() == TK_CONSTANT) {
+			snprintf(value, sizeof(value), " = 0x%016llX%016llX",
+				(unsigned long long)(tk.u128() >> 64), (unsigned long long)tk.u128());
+		}
+		result += std::to_string(tk.line()) + " " + type_names[tk.type()] + " "
+			+ std::string(tk.value()) + value + "\n";
+	}
+	return result;
+}
+
+/* Two changes since the baseline are on purpose: negative constants
+   were 64 bits wide, with the upper half zero, and character constants
+   had no text. The baseline line is brought up to date for those. */
+static std::string update_baseline(std::string line, const std::string& current)
+{
+	const size_t type = line.find(' ') + 1;
+	if (line.compare(type, 9, "Constant ") != 0) return line;
+	const size_t text = type + 9;
+	const size_t value = line.find(" = 0x", text);
+	if (value == std::string::npos) return line;
+	if (line[text] == '-' && line.compare(value + 5, 16, "0000000000000000") == 0
+		&& line[value + 21] >= '8')
+		line.replace(value + 5, 16, "FFFFFFFFFFFFFFFF");
+	const size_t current_text = current.find(" Constant '");
+	if (value == text && current_text == type - 1)
+		line.insert(text, current, current_text + 10, current.find(" = 0x") - current_text - 10);
+	return line;
+}
+
+/* Compares the programs named in the baseline, returning the number of
+   lines that differ */
+static unsigned compare_baseline(const std::string& source_dir)
+{
+	std::istringstream baseline(load(source_dir + "/tests/lexer_baseline.txt"));
+	std::istringstream current;
+	std::string line, program;
+	unsigned lines = 0, failures = 0;
+	const auto check_end = [&] {
+		std::string rest;
+		if (!program.empty() && std::getline(current, rest)) {
+			failures++;
+			fprintf(stderr, "%s has more tokens than the baseline, from: %s\n",
+				program.c_str(), rest.c_str());
+		}
+	};
+	while (std::getline(baseline, line)) {
+		if (line.compare(0, 2, "# ") == 0) {
+			check_end();
+			program = line.substr(2);
+			current = std::istringstream(dump(load(source_dir + "/programs/" + program)));
+			continue;
+		}
+		std::string result;
+		std::getline(current, result);
+		lines++;
+		if (update_baseline(line, result) == result) continue;
+		if (failures++ < 10) {
+			fprintf(stderr, "%s differs from the baseline:\n-- Baseline: %s\n-- Current:  %s\n",
+				program.c_str(), line.c_str(), result.c_str());
+		}
+	}
+	check_end();
+	printf("Baseline: %u tokens, %u differences\n", lines, failures);
+	return failures;
+}
+
+int main(int argc, char** argv)
+{
+	const unsigned iterations = (argc > 1) ? atoi(argv[1]) : 200000;
+	const unsigned baseline_failures = (argc > 2) ? compare_baseline(argv[2]) : 0;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	struct { const char* name; split_func_t split; bool supported; } lexers[] = {
+		{"SSE2", split_sse2, (bool)__builtin_cpu_supports("sse2")},
+		{"AVX2", split_avx2, (bool)__builtin_cpu_supports("avx2")},
+	};
+	std::mt19937 rng(2);
+	unsigned failures = 0;
+	for (unsigned i = 0; i < iterations; i++) {
+		const std::string input = random_input(rng, i % 3);
+		const std::string expected = lex(split_scalar, input);
+		for (const auto& lexer : lexers) {
+			if (!lexer.supported) continue;
+			const std::string result = lex(lexer.split, input);
+			if (result == expected) continue;
+			if (failures++ < 10) {
+				fprintf(stderr, "%s lexer differs on input:\n%s\n-- Scalar:\n%s-- %s:\n%s\n",
+					lexer.name, input.c_str(), expected.c_str(), lexer.name, result.c_str());
+			}
+		}
+	}
+	for (const auto& lexer : lexers)
+		printf("%s: %s\n", lexer.name, lexer.supported ? "compared" : "not supported");
+	printf("%u inputs, %u differences\n", iterations, failures);
+	return failures != 0 || baseline_failures != 0;
+#else
+	(void)iterations;
+	printf("Only the scalar lexer is built on this target\n");
+	return baseline_failures != 0;
+#endif
+}
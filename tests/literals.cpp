@@ -0,0 +1,55 @@
+#include "assembler.hpp"
+#include <cstdio>
+
+/* Pins the values of numeric literals as the lexer makes them. Negative
+   literals are two's complement over all 128 bits: -1 is 128 one bits.
+   Before literals were parsed without allocating, -1 was 64 one bits,
+   with the upper half zero. */
+
+using u128 = unsigned __int128;
+static constexpr u128 ONES64 = ~(uint64_t)0;
+static constexpr u128 ONES128 = ~(u128)0;
+
+static const struct {
+	const char* text;
+	u128 value;
+} cases[] = {
+	{"-1", ONES128},
+	{"-0x1", ONES128},
+	{"-0b1", ONES128},
+	{"-2", ONES128 - 1},
+	{"-9223372036854775808", ONES128 << 63},
+	{"-0x8000_0000_0000_0000_0000_0000_0000_0000", (u128)1 << 127},
+	/* Positive literals are never sign-extended */
+	{"0xFFFFFFFFFFFFFFFF", ONES64},
+	{"18446744073709551615", ONES64},
+	{"+1", 1},
+	{"0", 0},
+};
+
+static std::string hex(u128 value)
+{
+	char buffer[40];
+	snprintf(buffer, sizeof(buffer), "0x%016llX%016llX",
+		(unsigned long long)(value >> 64), (unsigned long long)value);
+	return buffer;
+}
+
+int main()
+{
+	unsigned failures = 0;
+	for (const auto& c : cases) {
+		StringArena arena;
+		const TokenStream tokens = Assembler::split(c.text, arena);
+		if (tokens.size() != 1 || tokens[0].type() != TK_CONSTANT) {
+			failures++;
+			fprintf(stderr, "%s is not one constant\n", c.text);
+		} else if (tokens[0].u128() != c.value) {
+			failures++;
+			fprintf(stderr, "%s is %s, expected %s\n", c.text,
+				hex(tokens[0].u128()).c_str(), hex(c.value).c_str());
+		}
+	}
+	printf("%zu literals, %u problems\n", std::size(cases), failures);
+	return failures != 0;
+}
@@ -0,0 +1,97 @@
+#include "assembler.hpp"
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+/* Expands macros whose arguments are expressions of several tokens,
+   and checks the data they put out. A macro whose expansion fails
+   must still be usable afterwards. */
+
+static const char* const definitions = R"(
+.macro put a, b
+	dw a
+	dw b
+.endm
+)";
+
+struct Case {
+	const char* source;
+	std::vector<uint32_t> expected;
+};
+static const Case cases[] = {
+	{"put 1, 2", {1, 2}},
+	{"put 1 + 2, (3 - 1) * 4", {3, 8}},
+	{"put -1, ~0 >> 100", {0xFFFFFFFF, 0x0FFFFFFF}},
+	{"put 5 6", {5, 6}},
+	/* Arguments are spliced as they are written */
+	{"put 1 + 1 << 2, 7", {8, 7}},
+	{"put 2 * 3, -(2 + 3)", {6, (uint32_t)-5}},
+};
+
+static std::string write_file(const std::string& dir, const std::string& name, const std::string& text)
+{
+	const std::string path = dir + "/" + name;
+	FILE* f = fopen(path.c_str(), "w");
+	if (f == nullptr) throw std::runtime_error("Could not write " + path);
+	fwrite(text.data(), 1, text.size(), f);
+	fclose(f);
+	return path;
+}
+
+int main()
+{
+	char dir[] = "/tmp/fab128_macrosXXXXXX";
+	if (mkdtemp(dir) == nullptr) {
+		perror("mkdtemp");
+		return 1;
+	}
+	std::vector<std::string> files;
+	unsigned failures = 0;
+	Options options;
+	Sources sources;
+	for (size_t i = 0; i < std::size(cases); i++) {
+		const auto& c = cases[i];
+		const auto path = write_file(dir, "case" + std::to_string(i) + ".asm",
+			std::string(definitions) + c.source + "\n");
+		files.push_back(path);
+		Assembler assembler {options, sources};
+		std::vector<uint32_t> result;
+		try {
+			assembler.assemble_file(path);
+			const auto& out = assembler.section(".text").output;
+			result.resize(out.size() / sizeof(uint32_t));
+			std::memcpy(result.data(), out.data(), result.size() * sizeof(uint32_t));
+		} catch (const std::exception& e) {
+			fprintf(stderr, "%s: %s\n", c.source, e.what());
+		}
+		if (result != c.expected) {
+			failures++;
+			fprintf(stderr, "Wrong values for: %s\n", c.source);
+		}
+	}
+
+	/* The failed expansion must not leave the macro marked as expanding */
+	const auto bad = write_file(dir, "bad.asm", std::string(definitions) + "put 1, 1 / 0\n");
+	const auto good = write_file(dir, "good.asm", "put 3, 4\n");
+	files.push_back(bad);
+	files.push_back(good);
+	Assembler assembler {options, sources};
+	try {
+		assembler.assemble_file(bad);
+		failures++;
+		fprintf(stderr, "Division by zero in a macro argument was not reported\n");
+	} catch (const std::exception&) {
+	}
+	try {
+		assembler.assemble_file(good);
+	} catch (const std::exception& e) {
+		failures++;
+		fprintf(stderr, "Expanding again after a failure: %s\n", e.what());
+	}
+
+	for (const auto& file : files)
+		unlink(file.c_str());
+	rmdir(dir);
+	printf("%zu macro expansions, %u problems\n", std::size(cases) + 2, failures);
+	return failures != 0;
+}